@@ -1,6 +1,8 @@
 #ifndef _APUE_DB_H_
 #define _APUE_DB_H_
 
+#include <sys/types.h>  // for off_t & time_t
+
 typedef void * DBHANDLE;
 
 /*
@@ -11,7 +13,14 @@ typedef void * DBHANDLE;
  * 
  * 如果需要建立新的数据库, mode 将作为第三个参数传递给 open.
  * 
- * 返回值: 若成功, 返回函数库具柄; 若失败, 返回NULL
+ * 如果 pathname 是一个目录(或 oflag 中包含 O_DIRECTORY, 此时若目录不存在则创建它),
+ * 则打开分片数据库: 在该目录下建立 NSHARD_DEF 对独立的文件 0.idx/0.dat, 1.idx/1.dat ...
+ * 分片数在建立目录时记录在其中的 nshard 文件里, 以后打开时以它为准.
+ * 记录按键的散列值分配到各个分片, 各分片拥有各自的空闲链表锁和追加锁,
+ * 不同分片的写操作互不竞争. 分片数据库的使用方式与普通数据库完全相同.
+ * 
+ * 返回值: 若成功, 返回函数库具柄; 若失败, 返回NULL (索引文件是没有世代字段的旧格式时
+ *         errno 为 EINVAL, 需要用 O_TRUNC 重新建立数据库)
  */
 DBHANDLE db_open(const char *, int, ...);
 
@@ -44,10 +53,30 @@ char *db_fetch(DBHANDLE, const char *);
  */
 int db_store(DBHANDLE, const char *, const char *, int);
 
+/*
+ * 与 db_store 相同, 但记录在 ttl 秒后过期(ttl 为 0 时永不过期).
+ * 
+ * 过期的记录对 db_fetch 和 db_nextrec 不可见, DB_INSERT, DB_REPLACE 和 db_delete
+ * 也把它视为不存在, 它占用的空间由 db_expire 回收.
+ * 
+ * 返回值: 与 db_store 相同; ttl 为负数, 或过期时间超过 999999999999 时
+ *         返回 -1 并将 errno 设置为 EINVAL
+ */
+int db_store_ttl(DBHANDLE, const char *, const char *, int, time_t);
+
+/*
+ * 回收最多 max 条已过期的记录, 将它们放入空闲链表. 过期索引 pathname.exp 按过期时间
+ * 分桶, 只读已过期的桶中的条目, 不需要扫描整个数据库, 设置了过期时间的写操作也只需
+ * 等待很短的时间. 可以由后台线程或定时任务周期性地调用.
+ * 
+ * 返回值: 回收的记录数
+ */
+int db_expire(DBHANDLE, int);
+
 /*
  * 通过指定 key, 在数据库中删除一条记录
  * 
- * 返回值: 若成功, 返回 0; 若没有找到记录, 返回 -1
+ * 返回值: 若成功, 返回 0; 若没有找到记录(或记录已过期), 返回 -1
  */
 int db_delete(DBHANDLE, const char *);
 
@@ -62,11 +91,150 @@ void db_rewind(DBHANDLE);
  * 然后返回这个指针
  * 
  * db_nextrec 不保证其返回记录的顺序, 只保证对数据库中的每一条记录只读取一次
+ * (进程在修改时被杀死后留下的, 不在任何散列链上的记录不会被读到)
  * 
  * 返回值: 若成功, 返回指向数据的指针; 若到达数据库文件的尾端, 返回 NULL
  */
 char *db_nextrec(DBHANDLE, char *);
 
+/*
+ * 开始一个事务.
+ * 
+ * 此后直到 db_txn_commit 或 db_txn_abort, 对该句柄调用的 db_store 和 db_delete
+ * 只在内存中记录下来(返回 0), 并不真正修改数据库. 同一个键多次操作时, 提交的结果与按顺序单独执行相同:
+ * 已提交的记录要满足第一次操作的条件(如 DB_INSERT 要求记录不存在), 之后的操作
+ * 依次检查前面的操作之后的状态, 数据库中最终保留最后一次操作的结果.
+ * 事务中的 db_fetch 读到的仍是已提交的数据.
+ * 
+ * 返回值: 若成功, 返回 0; 若已在事务中, 返回 -1 并将 errno 设置为 EINVAL
+ */
+int db_txn_begin(DBHANDLE);
+
+/*
+ * 提交事务.
+ * 
+ * 按(分片, 散列链)的固定顺序对涉及的所有散列链加写锁, 检查每个操作的前提条件,
+ * 然后执行所有操作: 需要追加的记录合并成对数据文件和索引文件的各一次写.
+ * 提交是隔离的: 其他句柄要么看到事务之前的状态, 要么看到全部操作完成后的状态.
+ * 
+ * 只要有一个操作的前提条件不满足, 所有操作都不执行:
+ * DB_INSERT 的记录已存在时返回 1; DB_REPLACE 或 db_delete 的记录不存在时
+ * 返回 -1 并将 errno 设置为 ENOENT.
+ * 
+ * 提交不是崩溃原子的: 没有恢复日志, 进程或系统在提交过程中终止时, 数据库中可能只有
+ * 一部分操作生效, 之后可以用 db_check 检查数据库的结构.
+ * 
+ * 返回值: 若成功, 返回 0; 若出错, 返回非 0 值
+ */
+int db_txn_commit(DBHANDLE);
+
+/*
+ * 放弃事务中记录的所有操作
+ */
+void db_txn_abort(DBHANDLE);
+
+/*
+ * 对数据库启用透明的数据压缩, 只能对还没有任何记录, 也没有其他句柄打开着的数据库调用
+ * (最好紧接在建立数据库的 db_open 之后).
+ * 
+ * samples 是 nsample 个典型的数据样本, 用来训练压缩字典, 字典保存在数据文件的头部.
+ * 长度小于 threshold 的数据, 以及压缩后没有变小的数据, 保存原始内容.
+ * 启用后 db_store 和 db_fetch 的用法不变.
+ * 
+ * 返回值: 若成功, 返回 0; 若数据库不为空, 返回 -1 并将 errno 设置为 ENOTEMPTY;
+ *         若还有其他句柄打开着数据库, 返回 -1 并将 errno 设置为 EBUSY
+ */
+int db_compress(DBHANDLE, const char **, int, int);
+
+/*
+ * 返回通过该句柄存入的数据的压缩比(原始字节数 / 写入字节数)
+ */
+double db_cmpratio(DBHANDLE);
+
+/*
+ * 为数据库开启变更流 pathname.log (分片数据库为目录中所有分片共用的 feed.log), 此后
+ * 所有进程通过 db_store 和 db_delete (包括事务) 所做的修改都按执行顺序追加到变更流中,
+ * 每条修改带有一个递增的序列号. 写者在修改记录到一半时终止, 没有提交的记录不会被读到.
+ * 
+ * 变更流不是崩溃原子的: 修改先写入数据库文件, 再追加到变更流. 写者在两者之间终止时,
+ * 这个修改(或事务中还没有提交到变更流的操作)已经生效, 却不会出现在变更流中, 之后的写者
+ * 会覆盖它未提交的记录. 副本从此与主数据库不一致且不会报错, 这时应该用 db_snapshot
+ * 重新建立副本.
+ * 
+ * 返回值: 若成功, 返回 0; 若出错, 返回 -1 (还有其他句柄打开着数据库时 errno 为 EBUSY)
+ */
+int db_feed(DBHANDLE);
+
+/*
+ * 将数据库 pathname 的变更流中, 从偏移量 *offp 开始的所有已提交的修改应用到数据库(通常是
+ * 同一台机器上的副本), 并更新 *offp 和 *seqp (最后应用的序列号, 初始为 0 和 0).
+ * 反复调用即可使副本跟上主数据库, 开销只与写入量成正比. 事务(包括跨分片的事务)
+ * 在副本中也整体提交.
+ * 
+ * 返回值: 若成功, 返回应用的修改数; 若出错, 返回 -1 (序列号不连续时 errno 为 EILSEQ)
+ */
+int db_feed_apply(DBHANDLE, const char *, off_t *, long long *);
+
+/*
+ * 在数据库正常读写的同时, 建立它在某一时刻的一致副本: pathname.idx 和 pathname.dat
+ * (分片数据库则在目录 pathname 中建立各分片的副本), 副本可以直接用 db_open 打开.
+ * 
+ * 复制期间只阻塞写操作, 读操作不受影响. 文件系统支持 reflink 时副本与原文件共享数据块,
+ * 写操作只被阻塞很短的时间; 否则退化为完整复制, 写操作要等到复制完成.
+ * 
+ * 返回值: 若成功, 返回 0; 若出错, 返回 -1
+ */
+int db_snapshot(DBHANDLE, const char *);
+
+/*
+ * 为数据库建立或重建布隆过滤器 pathname.blm (分片数据库每个分片一个). db_fetch 和
+ * db_delete 先查询键所在散列链的过滤器, 对不存在的键不加锁也不读散列链就直接返回.
+ * 新建的数据库自动带有过滤器(重新建立时若有其他句柄打开着没有过滤器的旧数据库则除外);
+ * 为已有的数据库建立过滤器时不能有其他句柄打开着它, 否则返回 -1 并将 errno 设置为 EBUSY.
+ * 删除的键在过滤器中留下的位不会清除, 大量删除之后可以再次调用以重建过滤器.
+ * 新建数据库的过滤器按少量记录设定大小; db_bloom 按当前记录数(每条记录约 10 位,
+ * 并留出一倍的增长余地)重新设定大小, 记录数大量增加之后也应再次调用.
+ * 改变大小同样要求没有其他句柄打开着数据库, 否则只按原来的大小重建.
+ * 
+ * 返回值: 若成功, 返回 0; 若出错, 返回 -1
+ */
+int db_bloom(DBHANDLE);
+
+/*
+ * 为数据库建立共享内存目录 pathname.shm (分片数据库每个分片一个). 此后打开数据库的
+ * 每个句柄都把它映射到内存, 散列链的锁改为其中进程间共享的 robust 互斥量, 散列链的
+ * 第一个指针也直接从中读取, 没有竞争时查找和加锁都不需要系统调用. 持有锁的进程终止时,
+ * 下一个加锁的进程接管该锁. 第一个打开数据库的句柄根据索引文件重新建立目录.
+ * 只能在没有其他句柄打开数据库时调用(本进程缓存中的句柄先被关闭), 否则返回 -1
+ * 并将 errno 设置为 EBUSY.
+ * 
+ * 互斥量不区分读写, 读同一散列链的操作也相互排斥, 适合大量进程同时读写不同键的场合.
+ * 
+ * 返回值: 若成功, 返回 0; 若出错, 返回 -1
+ */
+int db_shm(DBHANDLE);
+
+/*
+ * 设置每个进程最多保留 n 个已关闭的句柄(默认为 0, 即不保留). db_close 关闭的句柄
+ * 连同打开的文件和映射一起留在缓存中, 以相同的路径名和读写方式再次 db_open 时直接取回,
+ * 几乎没有开销. 数据库文件被删除或重新建立(包括以 O_TRUNC 截断), 或者 .log, .exp,
+ * .blm, .shm 等附属文件出现, 消失或被替换后, 缓存中的句柄不会再被使用.
+ * 
+ * 缓存中的句柄相当于仍然打开着数据库: 只要其他进程的缓存中还有它的句柄,
+ * db_compress, db_feed, db_bloom 和 db_shm 等改变所有句柄访问方式的调用就返回 EBUSY
+ * (调用进程自己缓存的句柄会先被关闭). fork 产生的子进程不继承缓存.
+ */
+void db_cache(int);
+
+/*
+ * 检查数据库的结构是否完整: 每条散列链和空闲链表都能走到尾, 没有环, 一条索引记录
+ * 只出现在一条链上, 键属于它所在的散列链, 数据记录在数据文件范围内并以换行符结尾.
+ * 检查期间阻塞写操作. 用于压力测试, 以及进程在修改数据库时被杀死之后.
+ * 
+ * 返回值: 发现的错误数, 0 表示完整; 若出错, 返回 -1
+ */
+int db_check(DBHANDLE);
+
 /*
  * Flags for db_store()
  */
@@ -76,10 +244,17 @@ char *db_nextrec(DBHANDLE, char *);
 
 /*
  * Implementation limits
+ * 
+ * IDXLEN_MAX 和 DATLEN_MAX 决定每个句柄的缓冲区大小, 可以在编译时重新定义
+ * (例如 -DDATLEN_MAX=4096, 都不能超过 9999), 库和使用它的程序必须使用相同的值
  */
 #define IDXLEN_MIX 6        // key, sep, start, sep, length, \n
+#ifndef IDXLEN_MAX
 #define IDXLEN_MAX 1024     // arbitrary
+#endif
 #define DATLEN_MIN 2        // data byte, newline
+#ifndef DATLEN_MAX
 #define DATLEN_MAX 1024     // arbitrary
+#endif
 
 #endif /* _APUE_DB_H_ */
@@ -1,31 +1,71 @@
 #include "db.h"
 
+/*
+ * Per-process handle pool and cache, shared by all threads.
+ */
+static pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;
+static DB  *dbpool;         // free DB structs, with their buffers
+static int npool;
+static DB  *dbcache;        // closed handles still open, most recent first
+static int ncache;
+static int maxcache;        // set by db_cache
+
 DBHANDLE db_open(const char *pathname, int oflag, ...)
+{
+    int mode = 0;
+    struct stat statbuff;
+
+    if (oflag & O_CREAT) {
+        va_list ap;
+
+        va_start(ap, oflag);
+        mode = va_arg(ap, int);
+        va_end(ap);
+    }
+
+    // pathname 是目录时打开分片数据库, 否则打开单个的索引文件和数据文件
+    if ((oflag & O_DIRECTORY) ||
+        (stat(pathname, &statbuff) == 0 && S_ISDIR(statbuff.st_mode))) {
+        return _db_openshards(pathname, oflag & ~O_DIRECTORY, mode);
+    }
+    return _db_openfile(pathname, oflag, mode);
+}
+
+static DB *_db_openfile(const char *pathname, int oflag, int mode)
 {
     DB *db;
-    int len, mode;
+    int len, fd, init = 0;
     size_t i;
+    struct timespec ts;
     char asciiptr[PTR_SZ + 1],
-         hash[(NHASH_DEF + 1) * PTR_SZ + 2];    // +2 for newline and null
-    struct stat statbuff;
+         hash[(NHASH_DEF + 1) * PTR_SZ + GEN_SZ + 2];   // +2 for newline and null
+
+    // 缓存中有以同样方式打开的句柄时直接取回, 不需要再打开任何文件
+    if ((db = _db_cachefind(pathname, oflag)) != NULL) {
+        db->logdb = db;
+        db_rewind(db);
+        return db;
+    }
 
     len = strlen(pathname);
     if ((db = _db_alloc(len)) == NULL) {
         err_dump("db_open: _db_alloc error for DB");
     }
+    db->accmode = oflag & O_ACCMODE;
+    db->logdb   = db;           // change feed of its own
     db->nhash   = NHASH_DEF;    // hash table size
     db->hashoff = HASH_OFF;     // offset in index file of hash table
+    db->recoff  = GEN_OFF + GEN_SZ + 1;     // +1 for newline
     strcpy(db->name, pathname);
     strcat(db->name, ".idx");
 
     if (oflag & O_CREAT) {
-        va_list ap;
-
-        va_start(ap, oflag);
-        mode = va_arg(ap, int);
-        va_end(ap);
-
         // open index file and data file.
+        // 新建数据库时不在 open 中截断文件, 而是在下面加锁之后截断
+        if (oflag & O_TRUNC) {
+            oflag &= ~O_TRUNC;
+            init = 1;
+        }
         db->idxfd = open(db->name, oflag, mode);
         strcpy(db->name + len, ".dat");
         db->datfd = open(db->name, oflag, mode);
@@ -41,59 +81,276 @@ DBHANDLE db_open(const char *pathname, int oflag, ...)
         return NULL;
     }
 
-    if ((oflag & (O_CREAT | O_TRUNC)) == (O_CREAT | O_TRUNC)) {
+    // 每个句柄在关闭之前一直持有 OPEN_OFF 的读锁, 在 db_shm 等调用持有写锁期间等待.
+    // 先加锁再查看 pathname.shm 等文件, 不会错过在此之前建立的文件
+    if (_db_lockw(db->idxfd, F_RDLCK, OPEN_OFF, SEEK_SET, 1) < 0) {
+        err_dump("db_open: readw_lock error");
+    }
+
+    // 共享内存目录 pathname.shm 存在时, 所有句柄都通过它锁定和查找散列链
+    strcpy(db->name + len, ".shm");
+    if ((fd = open(db->name, O_RDWR)) >= 0) {
+        if (_db_shm_attach(db, fd) < 0) {
+            close(fd);
+            _db_free(db);
+            return NULL;
+        }
+    } else if (errno != ENOENT) {
+        _db_free(db);
+        return NULL;
+    }
+
+    if (init) {
         /*
          * If the database was create, we have to initialize it.
-         * Write lock the entire file so that we can stat it,
-         * check its size, and initialize it, atomically.
+         * Write lock the entire file so that we can truncate it,
+         * and initialize it, atomically. With a shared directory
+         * the other handles lock its chains instead, lock them all.
          */
-        if (writew_lock(db->idxfd, 0, SEEK_SET, 0) < 0) {
+        _db_lockall(db);
+        if (_db_lockw(db->idxfd, F_WRLCK, 0, SEEK_SET, OPEN_OFF) < 0) {
             err_dump("dp_open: writew_lock error");
         }
-
-        if (fstat(db->idxfd, &statbuff) < 0) {
-            err_sys("db_open: fstat error");
+        // 截断之前取得旧文件的世代, 新的世代一定比它大
+        db->gen = _db_readgen(db) + 1;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        if ((long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 > db->gen) {
+            db->gen = (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+        }
+        if (ftruncate(db->idxfd, 0) < 0 || ftruncate(db->datfd, 0) < 0) {
+            err_sys("db_open: ftruncate error");
         }
 
-        if (statbuff.st_size == 0) {
-            /*
-             * We have to build a list of (NHASH_DEF + 1) chain
-             * ptrs with a value of 0. The +1 is for the free
-             * list pointer that precedes the hash table.
-             */
-            sprintf(asciiptr, "%*d", PTR_SZ, 0);
-            hash[0] = 0;
-            for (i = 0; i < NHASH_DEF + 1; i++) {
-                strcat(hash, asciiptr);
-            }
-            strcat(hash, "\n");
-            i = strlen(hash);
-            if (write(db->idxfd, hash, i) != i) {
-                err_dump("dp_open: index file init write error");
+        /*
+         * We have to build a list of (NHASH_DEF + 1) chain
+         * ptrs with a value of 0. The +1 is for the free
+         * list pointer that precedes the hash table.
+         */
+        sprintf(asciiptr, "%*d", PTR_SZ, 0);
+        hash[0] = 0;
+        for (i = 0; i < NHASH_DEF + 1; i++) {
+            strcat(hash, asciiptr);
+        }
+        sprintf(hash + strlen(hash), "%*lld\n", GEN_SZ, db->gen);
+        i = strlen(hash);
+        if (_db_writen(db->idxfd, hash, i, 0) != i) {
+            err_dump("dp_open: index file init write error");
+        }
+        if (db->shm != NULL) {
+            for (i = 0; i < db->nhash; i++) {
+                _db_shm_reload(db, i);
             }
         }
-        if (un_lock(db->idxfd, 0, SEEK_SET, 0) < 0) {
+
+        // 新建的数据库带有布隆过滤器 pathname.blm, 在锁内建立并清空,
+        // 其他句柄打开时不会看到长度不对的过滤器文件
+        strcpy(db->name + len, ".blm");
+        _db_bloom_open(db, oflag, init);
+        if (_db_unlock(db->idxfd, 0, SEEK_SET, OPEN_OFF) < 0) {
             err_dump("dp_open: un_lock error");
         }
+        _db_unlockall(db);
+    } else {
+        // 已有的数据库有过滤器则使用, 在索引文件的读锁下打开, 不会遇到正在重新建立的过滤器
+        if (_db_lockw(db->idxfd, F_RDLCK, 0, SEEK_SET, OPEN_OFF) < 0) {
+            err_dump("db_open: readw_lock error");
+        }
+        db->gen = _db_readgen(db);
+
+        // 非空的索引文件没有世代字段, 是旧格式的数据库: 散列表之后就是索引记录,
+        // db_fetch 还能找到记录, db_nextrec 却从错误的位置开始读, 所以拒绝打开
+        if (db->gen == 0 && lseek(db->idxfd, 0, SEEK_END) > 0) {
+            if (_db_unlock(db->idxfd, 0, SEEK_SET, OPEN_OFF) < 0) {
+                err_dump("db_open: un_lock error");
+            }
+            _db_free(db);
+            errno = EINVAL;
+            return NULL;
+        }
+        strcpy(db->name + len, ".blm");
+        _db_bloom_open(db, oflag, init);
+        if (_db_unlock(db->idxfd, 0, SEEK_SET, OPEN_OFF) < 0) {
+            err_dump("db_open: un_lock error");
+        }
+    }
+    _db_loaddict(db);
+
+    // 变更流文件 pathname.log 存在时, 每个可写的句柄都要把修改记录到其中.
+    // 重新建立数据库时删除旧的变更流
+    strcpy(db->name + len, ".log");
+    if (init) {
+        unlink(db->name);
+    } else if ((oflag & O_ACCMODE) != O_RDONLY) {
+        db->logfd = open(db->name, O_RDWR);
+    }
+
+    // 过期索引 pathname.exp 同样随数据库一起删除
+    strcpy(db->name + len, ".exp");
+    if (init) {
+        unlink(db->name);
+    } else if ((oflag & O_ACCMODE) != O_RDONLY) {
+        db->expfd = open(db->name, O_RDWR);
+    }
+    db_rewind(db);
+    return db;
+}
+
+static DB *_db_openshards(const char *pathname, int oflag, int mode)
+{
+    DB  *db;
+    int i, n;
+
+    if ((oflag & O_CREAT) && mkdir(pathname, mode | S_IRWXU) < 0 && errno != EEXIST) {
+        return NULL;
+    }
+
+    // 分片数以目录中记录的为准, 新建的目录记录 NSHARD_DEF
+    if ((n = _db_nshard(pathname, (oflag & O_CREAT) ? NSHARD_DEF : 0, mode)) < 0) {
+        return NULL;
+    }
+
+    // 顶层的DB结构只打开变更流, 并保存各个分片的句柄; name 缓冲区多出的字节
+    // 足够存放 "/999" 或 "/feed.log" 和 null, 用来构造各分片和变更流的路径名
+    if ((db = _db_alloc(strlen(pathname) + sizeof(FEED_NAME))) == NULL) {
+        err_dump("db_open: _db_alloc error for DB");
+    }
+    if ((db->shard = calloc(n, sizeof(DB *))) == NULL) {
+        err_dump("db_open: calloc error for shards");
+    }
+    db->nshard = n;
+
+    for (i = 0; i < db->nshard; i++) {
+        sprintf(db->name, "%s/%d", pathname, i);
+        if ((db->shard[i] = _db_openfile(db->name, oflag, mode)) == NULL) {
+            _db_free(db);
+            return NULL;
+        }
+        db->shard[i]->logdb = db;
     }
+
+    // 所有分片共用目录中的变更流, 跨分片的事务在其中也是一个整体.
+    // 打开所有分片之后再查看, 与 _db_openfile 一样不会错过之前由 db_feed 建立的变更流
+    sprintf(db->name, "%s/%s.log", pathname, FEED_NAME);
+    if (oflag & O_TRUNC) {
+        unlink(db->name);
+    } else if ((oflag & O_ACCMODE) != O_RDONLY) {
+        db->logfd = open(db->name, O_RDWR);
+    }
+    strcpy(db->name, pathname);
     db_rewind(db);
     return db;
 }
 
+static int _db_nshard(const char *pathname, int nshard, int mode)
+{
+    // 新建目录时先写临时文件再用 link 建立 NSHARD_NAME, 读者不会看到写了一半的文件,
+    // 同时建立目录的多个进程中只有第一个的 link 成功, 其余的使用它记录的分片数
+
+    char    *name, *tmp, buf[16];
+    int     fd, n;
+    ssize_t len;
+
+    len = strlen(pathname);
+    if ((name = malloc(2 * (len + sizeof(NSHARD_NAME) + 16))) == NULL) {
+        err_dump("_db_nshard: malloc error");
+    }
+    tmp = name + len + sizeof(NSHARD_NAME) + 16;
+    sprintf(name, "%s/%s", pathname, NSHARD_NAME);
+    if (nshard > 0 && access(name, F_OK) < 0) {
+        sprintf(tmp, "%s/%s.%ld", pathname, NSHARD_NAME, (long)getpid());
+        sprintf(buf, "%d\n", nshard);
+        if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, mode & 0666)) < 0) {
+            free(name);
+            return -1;
+        }
+        n = strlen(buf);
+        if (_db_writen(fd, buf, n, -1) != n) {
+            err_dump("_db_nshard: write error");
+        }
+        close(fd);
+        if (link(tmp, name) < 0 && errno != EEXIST) {
+            unlink(tmp);
+            free(name);
+            return -1;
+        }
+        unlink(tmp);
+    }
+
+    fd = open(name, O_RDONLY);
+    free(name);
+    if (fd < 0) {
+        return -1;
+    }
+    len = _db_readn(fd, buf, sizeof(buf) - 1, 0);
+    close(fd);
+    if (len < 2 || buf[len - 1] != NEWLINE) {
+        errno = EINVAL;
+        return -1;
+    }
+    buf[len] = 0;
+    if ((n = atoi(buf)) < 1 || n > 999) {
+        errno = EINVAL;
+        return -1;
+    }
+    return n;
+}
+
+static int _db_shard(DB *db, const char *key)
+{
+    // 分片使用与 _db_hash 不同的散列函数(FNV-1a),
+    // 以免同一分片内的键又集中到少数几条散列链上
+    DBHASH hval = 2166136261UL;
+
+    while (*key != 0) {
+        hval ^= (unsigned char)*key++;
+        hval *= 16777619UL;
+    }
+    return hval % db->nshard;
+}
+
 static DB *_db_alloc(int namelen)
 {
-    DB *db;
+    DB     *db, **pp;
+    char   *name, *idxbuf, *datbuf, *encbuf;
+    size_t namesz;
+
+    // 先从池中取一个名字缓冲区足够大的DB结构, 保留它的缓冲区, 其余字段清零
+    pthread_mutex_lock(&poollock);
+    for (pp = &dbpool; (db = *pp) != NULL; pp = &db->next) {
+        if (db->namesz >= namelen + 5) {
+            *pp = db->next;
+            npool--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&poollock);
+    if (db != NULL) {
+        name = db->name;
+        namesz = db->namesz;
+        idxbuf = db->idxbuf;
+        datbuf = db->datbuf;
+        encbuf = db->encbuf;
+        memset(db, 0, sizeof(DB));
+        db->name = name;
+        db->namesz = namesz;
+        db->idxbuf = idxbuf;
+        db->datbuf = datbuf;
+        db->encbuf = encbuf;
+        db->idxfd = db->datfd = db->logfd = db->expfd = db->shmfd = -1;
+        return db;
+    }
 
     // use calloc, to initialize the structure to zero.
     if ((db = calloc(1, sizeof(DB))) == NULL) {
         err_dump("_db_alloc: calloc error for DB");
     }
-    db->idxfd = db->datfd = -1;     // descriptors
+    db->idxfd = db->datfd = db->logfd = db->expfd = db->shmfd = -1;     // descriptors
 
     // allocate room for the name, +5 for ".idx" or ".dat" plus null at end.
     if ((db->name = malloc(namelen + 5)) == NULL) {
         err_dump("_db_alloc: malloc error for name");
     }
+    db->namesz = namelen + 5;
 
     // allocate an index buffer and a data buffer,
     // +2 for newline and null at end.
@@ -103,6 +360,9 @@ static DB *_db_alloc(int namelen)
     if ((db->datbuf = malloc(DATLEN_MAX + 2)) == NULL) {
         err_dump("_db_alloc: malloc error for data buffer");
     }
+    if ((db->encbuf = malloc(DATLEN_MAX + 2)) == NULL) {
+        err_dump("_db_alloc: malloc error for encode buffer");
+    }
 
     return db;
 }
@@ -112,21 +372,40 @@ int db_delete(DBHANDLE h, const char *key)
     // db_delete用于删除与给定键匹配的一条记录
 
     DB  *db = h;
-    int rc  = 0;
+    int rc  = 0, expired;
+
+    if (db->intxn) {
+        return _db_txn_add(db, key, NULL, 0, 0);
+    }
+    if (db->nshard > 0) {
+        return db_delete(db->shard[_db_shard(db, key)], key);
+    }
+    if (!_db_bloom_test(db, key)) {
+        db->cnt_delerr++;
+        db->cnt_bloomneg++;
+        return -1;
+    }
 
     // 使用_db_find_and_lock来判断在数据库中该记录是否存在,
     // 第三个参数控制对散列表加写锁, 因为可能执行更改该链表的操作
     if (_db_find_and_lock(db, key, 1) == 0) {
-        // 存在则调用_db_dodelete函数执行删除该记录的操作
+        // 存在则调用_db_dodelete函数执行删除该记录的操作.
+        // 已过期但还没有被回收的记录视为不存在, 但顺便回收它
+        expired = _db_expired(db);
         _db_dodelete(db);
-        db->cnt_delok++;
+        _db_log(db, LOG_DELETE, key, NULL, 0, 0);
+        if (expired) {
+            rc = -1;
+            db->cnt_delerr++;
+            db->cnt_expired++;
+        } else {
+            db->cnt_delok++;
+        }
     } else {
         rc = -1;
         db->cnt_delerr++;
     }
-    if (un_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0) {
-        err_dump("db_delete: un_lock error");
-    }
+    _db_unlockchain(db, db->chainoff);
 
     return rc;
 }
@@ -150,18 +429,31 @@ static void _db_dodelete(DB *db)
 
     // 调用writew_lock对空闲链表加写锁, 防止两个不同进程同时删除不同链表上的记录产生相互影响,
     // 因为要将被删除的记录添加到空闲链表中, 这将改变空闲链表指针
-    if (writew_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0) {
+    if (_db_lockw(db->idxfd, F_WRLCK, FREE_OFF, SEEK_SET, 1) < 0) {
         err_dump("_db_dodelete: writew_lock error");
     }
 
+    // 先修改散列链中前一条记录的链指针, 使其指向被删除记录之后的记录, 从散列链中移除该记录.
+    // 进程在之后的任何一步被杀死, 这条记录只是不在任何链上, 散列链上不会出现
+    // 已清空的数据, 也不会接到空闲链表上
+    saveptr = db->ptrval;
+    _db_writeptr(db, db->ptroff, saveptr);
+
     // 调用_db_writedat清空数据记录,
     // 此时db_delete对这条记录的散列链已经加了写锁, 故这里不需要对数据文件加锁
-    _db_writedat(db, db->datbuf, db->datoff, SEEK_SET);
+    _db_writedat(db, db->datbuf, db->datlen - 1, db->datoff, SEEK_SET);
 
     // 读空闲链表指针
     freeptr = _db_readptr(db, FREE_OFF);
 
-    saveptr = db->ptrval;
+    // 用空格重写索引记录, 并将其链指针指向原空闲链表的第一条记录
+    _db_writeidx(db, db->idxbuf, db->idxoff, SEEK_SET, freeptr);
+
+    // 将被删除的记录放到空闲链表的头部
+    _db_writeptr(db, FREE_OFF, db->idxoff);
+    if (_db_unlock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0) {
+        err_dump("_db_dodelete: un_lock error");
+    }
 }
 
 char *db_fetch(DBHANDLE h, const char *key)
@@ -171,6 +463,17 @@ char *db_fetch(DBHANDLE h, const char *key)
     DB   *db = h;
     char *ptr;
 
+    if (db->nshard > 0) {
+        return db_fetch(db->shard[_db_shard(db, key)], key);
+    }
+
+    // 布隆过滤器说不存在的键一定不存在, 不需要加锁和读散列链
+    if (!_db_bloom_test(db, key)) {
+        db->cnt_fetcherr++;
+        db->cnt_bloomneg++;
+        return NULL;
+    }
+
     // 调用_db_find_and_lock在数据库中查找记录
     if (_db_find_and_lock(db, key, 0) < 0) {
         // 若不能找到该记录, 则将返回值ptr设置为NULL, 并将不成功的搜索计数器之加1
@@ -178,13 +481,17 @@ char *db_fetch(DBHANDLE h, const char *key)
         db->cnt_fetcherr++;
     } else {
         // 如果找到了记录, 调用_db_readdat读相应的数据记录, 并将成功记录搜索计数器值加1
+        // 已过期但还没有被回收的记录视为不存在
         ptr = _db_readdat(db);
-        db->cnt_fetchok++;
+        if (db->expire != 0 && db->expire <= time(NULL)) {
+            ptr = NULL;
+            db->cnt_fetcherr++;
+        } else {
+            db->cnt_fetchok++;
+        }
     }
 
-    if (un_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0) {
-        err_dump("db_fetch: un_lock error");
-    }
+    _db_unlockchain(db, db->chainoff);
     return ptr;
 }
 
@@ -194,22 +501,20 @@ static int _db_find_and_lock(DB *db, const char *key, int writelock)
     // 在搜索记录时, 如果想在索引文件上加一把写锁, 则将writelock参数设置为非0值,
     // 如果将writelock参数设置为0, 则给索引文件上加读锁
 
-    off_t offset, nextoffset;
-
     // 将键转换为散列值, 用其计算在文件中相应散列链的起始地址(chainoff).
     db->chainoff = (_db_hash(db, key) * PTR_SZ) + db->hashoff;
-    db->ptroff = db->chainoff;
 
     // 等待获得锁, 注意, 只锁该散列链开始处的第一个字节
-    if (writelock) {
-        if (writew_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0) {
-            err_dump("_db_find_and_lock: writew_lock error");
-        }
-    } else {
-        if (readw_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0) {
-            err_dump("_db_find_and_lock: readw_lock error");
-        }
-    }
+    _db_lockchain(db, db->chainoff, writelock);
+    return _db_find(db, key);
+}
+
+static int _db_find(DB *db, const char *key)
+{
+    off_t offset, nextoffset;
+
+    db->chainoff = (_db_hash(db, key) * PTR_SZ) + db->hashoff;
+    db->ptroff = db->chainoff;
 
     // 调用_db_readptr读散列链中的第一个指针. 如果该函数返回0, 则该散列链为空
     offset = _db_readptr(db, db->ptroff);
@@ -235,17 +540,43 @@ static int _db_find_and_lock(DB *db, const char *key, int writelock)
 
 int db_store(DBHANDLE h, const char *key, const char *data, int flag)
 {
-    DB    *db = h;
-    int   rc, keylen, datlen;
-    off_t ptrval;
+    return _db_store(h, key, data, flag, 0);
+}
+
+int db_store_ttl(DBHANDLE h, const char *key, const char *data, int flag, time_t ttl)
+{
+    // 过期时间必须能用 EXP_SZ 个字符表示
+    if (ttl < 0 || ttl > EXP_MAX - time(NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+    return _db_store(h, key, data, flag, ttl == 0 ? 0 : time(NULL) + ttl);
+}
+
+static int _db_store(DB *db, const char *key, const char *data, int flag, time_t expire)
+{
+    int        rc, keylen, datlen, expired;
+    size_t     len;
+    off_t      ptrval;
+    time_t     oldexp = 0;
+    const char *value = data;
 
     if (flag != DB_INSERT && flag != DB_REPLACE && flag != DB_STORE) {
         errno = EINVAL;
         return -1;
     }
 
+    if (db->intxn) {
+        return _db_txn_add(db, key, data, flag, expire);
+    }
+    if (db->nshard > 0) {
+        return _db_store(db->shard[_db_shard(db, key)], key, data, flag, expire);
+    }
+
+    // data 被替换为编码后的数据记录(过期时间, 压缩), 其中可能含有 null 字节
     keylen = strlen(key);
-    datlen = strlen(data) + 1;
+    data = _db_encode(db, data, expire, &len);
+    datlen = len + 1;
     if (datlen < DATLEN_MIN || datlen > DATLEN_MAX) {
         err_dump("db_store: invalid data length");
     }
@@ -261,6 +592,9 @@ int db_store(DBHANDLE h, const char *key, const char *data, int flag)
             goto doreturn;
         }
 
+        // 在新记录加入散列链之前设置布隆过滤器
+        _db_bloom_add(db, key);
+
         // 读散列链上第一项的偏移量
         ptrval = _db_readptr(db, db->chainoff);
 
@@ -269,7 +603,7 @@ int db_store(DBHANDLE h, const char *key, const char *data, int flag)
         if (_db_findfree(db, keylen, datlen) < 0) {
             // 第1种情况
             // 没有找到对应大小的空闲记录, 则将新纪录追加到索引文件和数据文件的末尾
-            _db_writedat(db, data, 0, SEEK_END);
+            _db_writedat(db, data, len, 0, SEEK_END);
             _db_writeidx(db, key, 0, SEEK_END, ptrval);
 
             // 调用_db_writeptr将新纪录添加到对应的散列链的头部
@@ -279,15 +613,23 @@ int db_store(DBHANDLE h, const char *key, const char *data, int flag)
             // 第2种情况
             // _db_findfree找到对应大小的空记录, 并将这条空记录从空闲链表中移除
             // 写入新的索引记录和数据记录, 并将新纪录添加到对应的散列链的头部
-            _db_writedat(db, data, db->datoff, SEEK_SET);
+            _db_writedat(db, data, len, db->datoff, SEEK_SET);
             _db_writeidx(db, key, db->idxoff, SEEK_SET, ptrval);
             _db_writeptr(db, db->chainoff, db->idxoff);
             db->cnt_stor2++;
         }
     } else {
-        // 记录存在
+        // 记录存在, 但已过期的记录视为不存在
         
-        if (flag == DB_INSERT) {
+        expired = _db_expired(db);
+        oldexp = expired ? 0 : db->expire;
+        if (flag == DB_REPLACE && expired) {
+            rc = -1;
+            db->cnt_storerr++;
+            errno = ENOENT;
+            goto doreturn;
+        }
+        if (flag == DB_INSERT && !expired) {
             rc = 1;
             db->cnt_storerr++;
             goto doreturn;
@@ -300,8 +642,11 @@ int db_store(DBHANDLE h, const char *key, const char *data, int flag)
             // 调用_db_dodelete删除已有记录, 将该删除记录放在空闲链表头部
             _db_dodelete(db);
 
+            // 删除后重新读散列链上第一项的偏移量
+            ptrval = _db_readptr(db, db->chainoff);
+
             // 调用_db_writedat和_db_writeidx将新记录追加到索引文件和数据文件的末尾
-            _db_writedat(db, data, 0, SEEK_END);
+            _db_writedat(db, data, len, 0, SEEK_END);
             _db_writeidx(db, key, 0, SEEK_END, ptrval);
 
             // 将新纪录添加到对应的散列表的头部
@@ -310,16 +655,18 @@ int db_store(DBHANDLE h, const char *key, const char *data, int flag)
         } else {
             // 第4种情况
             // 想要替换一条已有记录, 新数据记录的长度与已有记录的长度恰好一样, 此时只需要重写记录即可
-            _db_writedat(db, data, db->datoff, SEEK_SET);
+            _db_writedat(db, data, len, db->datoff, SEEK_SET);
             db->cnt_stor4++;
         }
     }
+    _db_log(db, LOG_STORE, key, value, expire, 0);
+    if (_db_expneed(oldexp, expire)) {
+        _db_expadd(db, key, expire);
+    }
     rc = 0;     // OK
 
 doreturn:
-    if (un_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0) {
-        err_dump("dp_store: un_lock error");
-    }
+    _db_unlockchain(db, db->chainoff);
     return rc;
 }
 
@@ -331,7 +678,7 @@ static int _db_findfree(DB *db, int keylen, int datlen)
     off_t offset, nextoffset, saveoffset;
 
     // 需要对空闲链表加写锁以避免其他使用空闲链表的进程相互影响
-    if (writew_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0) {
+    if (_db_lockw(db->idxfd, F_WRLCK, FREE_OFF, SEEK_SET, 1) < 0) {
         err_dump("_db_findfree: writew_lock error");
     }
 
@@ -341,7 +688,7 @@ static int _db_findfree(DB *db, int keylen, int datlen)
 
     // 循环遍历空闲链表以搜寻一个能够匹配键长度和数据长度的索引记录项
     while (offset != 0) {
-        nextoffset = _db_readptr(db, offset);
+        nextoffset = _db_readidx(db, offset);
         if (strlen(db->idxbuf) == keylen && db->datlen == datlen) {
             break;
         }
@@ -358,101 +705,2507 @@ static int _db_findfree(DB *db, int keylen, int datlen)
         rc = 0;
     }
 
-    if (un_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0) {
+    if (_db_unlock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0) {
         err_dump("_db_findfree: un_lock error");
     }
     return rc;
 }
 
-void db_close(DBHANDLE h)
+int db_txn_begin(DBHANDLE h)
 {
-    _db_free((DB *)h);      // close fds, free buffers & struct
-}
+    DB *db = h;
 
-static void _db_free(DB *db)
-{
-    if (db->idxfd >= 0)     { close(db->idxfd); }
-    if (db->datfd >= 0)     { close(db->datfd); }
-    if (db->idxbuf != NULL) { free(db->idxbuf); }
-    if (db->datbuf != NULL) { free(db->datbuf); }
-    if (db->name != NULL)   { free(db->name);   }
-    free(db);
+    if (db->intxn) {
+        errno = EINVAL;
+        return -1;
+    }
+    db->intxn = 1;
+    db->ntxnop = 0;
+    return 0;
 }
 
-static DBHASH _db_hash(DB *db, const char *key)
+static int _db_txn_add(DB *db, const char *key, const char *data, int flag, time_t expire)
 {
-    DBHASH hval = 0;
-    char c;
+    // 在内存中记录事务中的一个操作, 真正的修改推迟到 db_txn_commit
+
+    DBTXNOP *op;
+    DB      *sdb;
+    int     i, shardno;
+    size_t  len;
+    char    *value;
+
+    // 开启了变更流时, 还要保留原始数据以便提交时记录
+    shardno = db->nshard > 0 ? _db_shard(db, key) : 0;
+    sdb = db->nshard > 0 ? db->shard[shardno] : db;
+    value = NULL;
+    if (data != NULL && sdb->logdb->logfd >= 0 && (value = strdup(data)) == NULL) {
+        err_dump("_db_txn_add: strdup error for data");
+    }
+    if (data != NULL) {
+        data = _db_encode(sdb, data, expire, &len);
+        if (len + 1 < DATLEN_MIN || len + 1 > DATLEN_MAX) {
+            err_dump("db_store: invalid data length");
+        }
+    }
 
-    for (int i = 0; (c = *key++) != 0; i++) {
-        hval += c * i;      // ascii char times its 1-based index
+    // 同一个键只保留一个操作: 已提交的记录要满足第一次操作的前提条件,
+    // 提交后的结果由最后一次操作决定
+    for (i = 0; i < db->ntxnop; i++) {
+        if (strcmp(db->txnop[i].key, key) == 0) {
+            break;
+        }
     }
-    return (hval % db->nhash);
+    if (i == db->ntxnop) {
+        if (db->ntxnop == db->maxtxnop) {
+            db->maxtxnop = db->maxtxnop == 0 ? 16 : db->maxtxnop * 2;
+            if ((db->txnop = realloc(db->txnop, db->maxtxnop * sizeof(DBTXNOP))) == NULL) {
+                err_dump("_db_txn_add: realloc error for operations");
+            }
+        }
+        op = &db->txnop[db->ntxnop++];
+        if ((op->key = strdup(key)) == NULL) {
+            err_dump("_db_txn_add: strdup error for key");
+        }
+        op->flag = flag;
+        op->rc = 0;
+    } else {
+        // 之前的操作之后记录是否存在是已知的, 在这里检查这次操作的前提条件,
+        // 不满足时提交返回与单独执行时相同的结果
+        op = &db->txnop[i];
+        if (op->rc == 0 && flag == DB_INSERT && op->data != NULL) {
+            op->rc = 1;
+        } else if (op->rc == 0 && flag != DB_INSERT && flag != DB_STORE && op->data == NULL) {
+            op->rc = -1;    // DB_REPLACE or delete of a deleted record
+        }
+        free(op->data);
+        free(op->value);
+    }
+
+    op->value = value;
+    op->data = NULL;
+    if (data != NULL) {
+        if ((op->data = malloc(len)) == NULL) {
+            err_dump("_db_txn_add: malloc error for data");
+        }
+        memcpy(op->data, data, len);
+        op->datlen = len;
+    }
+    op->expire = expire;
+    op->shardno = shardno;
+    op->db = sdb;
+    op->chainoff = (_db_hash(op->db, key) * PTR_SZ) + op->db->hashoff;
+    op->append = 0;
+    return 0;
 }
 
-static char *_db_readdat(DB *db)
+static int _db_txn_cmp(const void *a, const void *b)
 {
-    // 在datoff和datlen已经被正确初始化后, _db_readdat函数将数据记录的内容读入DB结构
-    if (lseek(db->datfd, db->datoff, SEEK_SET) == -1) {
-        err_dump("_db_readdat: lseek error");
-    }
-    if (read(db->datfd, db->datbuf, db->datlen) != db->datlen) {
-        err_dump("_db_readdat: read error");
+    const DBTXNOP *op1 = a, *op2 = b;
+
+    if (op1->shardno != op2->shardno) {
+        return op1->shardno < op2->shardno ? -1 : 1;
     }
-    if (db->datbuf[db->datlen - 1] != NEWLINE) {
-        err_dump("_db_readdat: missing newline");
+    if (op1->chainoff != op2->chainoff) {
+        return op1->chainoff < op2->chainoff ? -1 : 1;
     }
-    db->datbuf[db->datlen - 1] = 0;     // replace newline with null
-    return db->datbuf;
+    return 0;
 }
 
-static off_t _db_readidx(DB *db, off_t offset)
+int db_txn_commit(DBHANDLE h)
 {
-    ssize_t      i;
-    char         *ptr1, *ptr2;
-    char         asciiptr[PTR_SZ + 1], asciilen[IDXLEN_SZ + 1];
-    struct iovec iov[2];
+    DB      *db = h, *sdb;
+    DBTXNOP *op;
+    int     i, j, rc, found, nappend;
 
-    // 按调用者提供的参数查找索引文件偏移量, 并记录在DB结构中
-    if ((db->idxoff = lseek(db->idxfd, offset, offset == 0 ? SEEK_CUR : SEEK_SET)) == -1) {
-        err_dump("_db_readix: lseek error");
+    if (!db->intxn) {
+        errno = EINVAL;
+        return -1;
     }
-
-    // 调用readv读在索引记录开始处的两个定长字段: 指向下一索引记录的链指针和该索引记录余下部分的长度
-    iov[0].iov_base = asciiptr;
-    iov[0].iov_len  = PTR_SZ;
-    iov[1].iov_base = asciilen;
-    iov[1].iov_len  = IDXLEN_SZ;
-    if ((i = readv(db->idxfd, &iov[0], 2)) != PTR_SZ + IDXLEN_SZ) {
-        if (i == 0 && offset == 0) {
-            return -1;      // EOF for db_nextree
+    db->intxn = 0;
+
+    // 所有进程都按(分片, 散列链偏移量)的顺序加锁, 不会产生死锁
+    qsort(db->txnop, db->ntxnop, sizeof(DBTXNOP), _db_txn_cmp);
+    for (i = 0; i < db->ntxnop; i++) {
+        op = &db->txnop[i];
+        if (i > 0 && _db_txn_cmp(op, op - 1) == 0) {
+            continue;       // chain already locked
         }
-        err_dump("_db_readidx: readv error of index record");
+        _db_lockchain(op->db, op->chainoff, 1);
     }
 
-    // 将下一记录的偏移量转换为整形, 并存放到ptrval字段中, 这将被用作此函数返回值
-    asciiptr[PTR_SZ] = 0;           // null terminate
-    db->ptrval = toll(asciiptr);    // offset of next key in chain
-
-    // 将索引记录的长度转换为整型，并存放到idxlen字段中
-    asciilen[IDXLEN_SZ] = 0;        // null terminate
-    if ((db->idxlen = atoi(asciilen)) < IDXLEN_MIX || db->idxlen > IDXLEN_MAX) {
-        err_dump("_db_readidx: invalid length");
+    // 第一遍: 检查每个操作的前提条件, 只要有一个不满足就什么都不做
+    rc = 0;
+    for (i = 0; i < db->ntxnop; i++) {
+        op = &db->txnop[i];
+        if (op->rc != 0) {
+            rc = op->rc;
+            break;
+        }
+        found = _db_find(op->db, op->key) == 0;
+        if (found && op->flag != DB_STORE && _db_expired(op->db)) {
+            found = 0;      // expired records count as missing, for deletes too
+        }
+        if (found) {
+            if (op->flag == DB_INSERT) {
+                rc = 1;
+                break;
+            }
+        } else if (op->flag != DB_INSERT && op->flag != DB_STORE) {
+            rc = -1;        // DB_REPLACE or delete of a missing record
+            break;
+        }
+    }
+    if (rc != 0) {
+        db->cnt_txnerr++;
+        goto doreturn;
     }
 
-    // 将索引记录的变长部分读入DB结构中的idxbuf字段. 该记录以null字符代替换行符结尾
-    if ((i = read(db->idxfd, db->idxbuf, db->idxlen)) != db->idxlen) {
-        err_dump("_db_readidx: read error of index record");
+    // 第二遍: 在原位置完成删除和等长替换, 并尽量复用空闲链表中的记录,
+    // 其余需要追加到文件末尾的记录只做标记.
+    // 修改直接写入文件, 没有恢复日志, 在此之后终止的进程可能只留下一部分操作
+    nappend = 0;
+    for (i = 0; i < db->ntxnop; i++) {
+        op = &db->txnop[i];
+        sdb = op->db;
+        if (op->data != NULL) {
+            _db_bloom_add(sdb, op->key);
+        }
+        op->expadd = op->data != NULL && op->expire != 0;
+        if (_db_find(sdb, op->key) == 0) {
+            op->expadd = op->data != NULL &&
+                         _db_expneed(_db_expired(sdb) ? 0 : sdb->expire, op->expire);
+            if (op->data == NULL) {
+                _db_dodelete(sdb);
+                sdb->cnt_delok++;
+                continue;
+            }
+            if (op->datlen + 1 == sdb->datlen) {
+                _db_writedat(sdb, op->data, op->datlen, sdb->datoff, SEEK_SET);
+                sdb->cnt_stor4++;
+                continue;
+            }
+            _db_dodelete(sdb);
+            sdb->cnt_stor3++;
+        } else if (op->data == NULL) {
+            continue;       // stored and then deleted in the transaction
+        } else if (_db_findfree(sdb, strlen(op->key), op->datlen + 1) == 0) {
+            _db_writedat(sdb, op->data, op->datlen, sdb->datoff, SEEK_SET);
+            _db_writeidx(sdb, op->key, sdb->idxoff, SEEK_SET, _db_readptr(sdb, op->chainoff));
+            _db_writeptr(sdb, op->chainoff, sdb->idxoff);
+            sdb->cnt_stor2++;
+            continue;
+        } else {
+            sdb->cnt_stor1++;
+        }
+        op->append = 1;
+        nappend++;
     }
-    if (db->idxbuf[db->idxlen - 1] != NEWLINE) {
-        err_dump("_db_readidx: missing newline");
+
+    // 第三遍: 每个分片的追加记录合并成一次写
+    for (i = 0; nappend > 0 && i < db->ntxnop; i = j) {
+        for (j = i; j < db->ntxnop && db->txnop[j].shardno == db->txnop[i].shardno; j++)
+            ;
+        _db_txn_append(db->txnop[i].db, &db->txnop[i], j - i);
     }
-    db->idxbuf[db->idxlen - 1] = 0;
 
-    // 将索引记录划分成3个字段: 键, 对应数据记录的偏移量和数据记录的长度
-    // strchr函数在给定字符串中找到第一个指定字符
-    if ((ptr1 = strchr(db->idxbuf, SEP)) == NULL) {
-        err_dump("_db_readix: missing first separator");
+    // 变更流中事务的操作连续记录(分片数据库的各分片共用一个变更流),
+    // 除最后一个外都标记为未完成
+    for (i = 0; i < db->ntxnop; i++) {
+        op = &db->txnop[i];
+        _db_log(op->db, op->data == NULL ? LOG_DELETE : LOG_STORE, op->key, op->value,
+                op->expire, i < db->ntxnop - 1);
+        if (op->expadd) {
+            _db_expadd(op->db, op->key, op->expire);
+        }
+    }
+    db->cnt_txnok++;
+
+doreturn:
+    for (i = db->ntxnop - 1; i >= 0; i--) {
+        op = &db->txnop[i];
+        if (i > 0 && _db_txn_cmp(op, op - 1) == 0) {
+            continue;
+        }
+        _db_unlockchain(op->db, op->chainoff);
+    }
+    _db_txn_free(db);
+    if (rc < 0) {
+        errno = ENOENT;
+    }
+    return rc;
+}
+
+static void _db_txn_append(DB *db, DBTXNOP *op, int nop)
+{
+    // 将一个分片中所有需要追加的记录先在内存中拼接好, 再对数据文件和索引文件各写一次.
+    // 操作已按散列链排序, 同一散列链上的新记录依次链接, 最后一条成为链首
+
+    char   *datbuf, *idxbuf, *ptr;
+    size_t datsz, idxsz;
+    off_t  datend, idxend, ptrval;
+    int    i, len, appended;
+
+    datsz = idxsz = 0;
+    for (i = 0; i < nop; i++) {
+        if (op[i].append) {
+            datsz += op[i].datlen + 1;
+            idxsz += PTR_SZ + IDXLEN_SZ + IDXLEN_MAX + 1;
+        }
+    }
+    if (datsz == 0) {
+        return;
+    }
+    if ((datbuf = malloc(datsz)) == NULL || (idxbuf = malloc(idxsz)) == NULL) {
+        err_dump("_db_txn_append: malloc error");
+    }
+
+    // 与 _db_writedat 和 _db_writeidx 一样, 追加前先锁住数据文件和索引文件的末尾
+    if (_db_lockw(db->datfd, F_WRLCK, 0, SEEK_SET, 0) < 0) {
+        err_dump("_db_txn_append: writew_lock error");
+    }
+    if (_db_lockw(db->idxfd, F_WRLCK, db->recoff, SEEK_SET, OPEN_OFF - db->recoff) < 0) {
+        err_dump("_db_txn_append: writew_lock error");
+    }
+    if ((datend = lseek(db->datfd, 0, SEEK_END)) == -1 ||
+        (idxend = lseek(db->idxfd, 0, SEEK_END)) == -1) {
+        err_dump("_db_txn_append: lseek error");
+    }
+
+    ptr = datbuf;
+    idxsz = 0;
+    ptrval = 0;
+    for (i = 0; i < nop; i++) {
+        // 链指针指向同一散列链上前一条新记录, 或原来的链首
+        if (i == 0 || op[i].chainoff != op[i - 1].chainoff) {
+            ptrval = _db_readptr(db, op[i].chainoff);
+        }
+        op[i].idxoff = ptrval;
+        if (!op[i].append) {
+            continue;
+        }
+
+        // 数据记录
+        db->datoff = datend + (ptr - datbuf);
+        db->datlen = op[i].datlen + 1;
+        memcpy(ptr, op[i].data, db->datlen - 1);
+        ptr += db->datlen;
+        ptr[-1] = NEWLINE;
+
+        // 索引记录
+        sprintf(db->idxbuf, "%s%c%lld%c%ld\n", op[i].key, SEP, (long long)db->datoff, SEP, (long)db->datlen);
+        len = strlen(db->idxbuf);
+        if (len < IDXLEN_MIX || len > IDXLEN_MAX) {
+            err_dump("_db_txn_append: invalid length");
+        }
+        op[i].idxoff = idxend + idxsz;
+        sprintf(idxbuf + idxsz, "%*lld%*d%s", PTR_SZ, (long long)ptrval, IDXLEN_SZ, len, db->idxbuf);
+        idxsz += PTR_SZ + IDXLEN_SZ + len;
+        ptrval = op[i].idxoff;
+    }
+
+    // 先写数据记录, 再写索引记录, 最后修改链首指针.
+    // 每条散列链最后一个操作的 idxoff 就是该链新的链首
+    if (lseek(db->datfd, datend, SEEK_SET) == -1 || lseek(db->idxfd, idxend, SEEK_SET) == -1) {
+        err_dump("_db_txn_append: lseek error");
+    }
+    if (_db_writen(db->datfd, datbuf, ptr - datbuf, -1) != ptr - datbuf) {
+        err_dump("_db_txn_append: write error of data records");
+    }
+    if (_db_writen(db->idxfd, idxbuf, idxsz, -1) != idxsz) {
+        err_dump("_db_txn_append: write error of index records");
+    }
+    for (i = 0, appended = 0; i < nop; i++) {
+        appended |= op[i].append;
+        if (i == nop - 1 || op[i + 1].chainoff != op[i].chainoff) {
+            if (appended) {
+                _db_writeptr(db, op[i].chainoff, op[i].idxoff);
+            }
+            appended = 0;
+        }
+    }
+
+    if (_db_unlock(db->idxfd, db->recoff, SEEK_SET, OPEN_OFF - db->recoff) < 0) {
+        err_dump("_db_txn_append: un_lock error");
+    }
+    if (_db_unlock(db->datfd, 0, SEEK_SET, 0) < 0) {
+        err_dump("_db_txn_append: un_lock error");
+    }
+    free(datbuf);
+    free(idxbuf);
+}
+
+void db_txn_abort(DBHANDLE h)
+{
+    DB *db = h;
+
+    if (db->intxn) {
+        db->intxn = 0;
+        db->cnt_txnerr++;
+    }
+    _db_txn_free(db);
+}
+
+static void _db_txn_free(DB *db)
+{
+    for (int i = 0; i < db->ntxnop; i++) {
+        free(db->txnop[i].key);
+        free(db->txnop[i].data);
+        free(db->txnop[i].value);
+    }
+    db->ntxnop = 0;
+}
+
+int db_bloom(DBHANDLE h)
+{
+    DB            *db = h;
+    unsigned char *bits;
+    size_t        blmsz, want;
+    off_t         offset, nrec;
+    int           fd, len, excl, rc = 0;
+    struct stat   statbuff;
+
+    if (db->nshard > 0) {
+        for (int i = 0; i < db->nshard; i++) {
+            if (db_bloom(db->shard[i]) < 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    // 没有过滤器的句柄插入时不设置过滤器的位, 其他句柄映射的过滤器大小也不能改变,
+    // 所以只能在没有其他句柄打开数据库时建立新的过滤器或改变它的大小;
+    // 有其他句柄时只按原来的大小重建已有的过滤器, 它们都已映射了它
+    excl = _db_lockexcl(db) == 0;
+    if (!excl && (db->bloom == NULL || errno == EBADF)) {
+        return -1;
+    }
+
+    // 对整个索引文件加写锁, 重建期间没有修改, 也没有正在读的散列链
+    _db_lockall(db);
+    if (_db_lockw(db->idxfd, F_WRLCK, 0, SEEK_SET, OPEN_OFF) < 0) {
+        err_dump("db_bloom: writew_lock error");
+    }
+
+    // 先数出记录数, 按每条记录 BLOOM_BITS 位计算每条散列链的过滤器大小.
+    // 大小不够或大出很多时按两倍重新分配, 留出记录数增长的余地
+    nrec = 0;
+    for (DBHASH i = 0; i < db->nhash; i++) {
+        offset = _db_readptr(db, db->hashoff + i * PTR_SZ);
+        while (offset != 0) {
+            offset = _db_readptr(db, offset);
+            nrec++;
+        }
+    }
+    want = (nrec * BLOOM_BITS / db->nhash + 7) / 8;
+    blmsz = db->blmsz;
+    if (db->bloom == NULL || (excl && (blmsz < want || blmsz > 4 * want))) {
+        blmsz = want * 2 < BLOOM_SZ ? BLOOM_SZ : want * 2 > BLOOM_MAX ? BLOOM_MAX : want * 2;
+    }
+
+    if (db->bloom == NULL || blmsz != db->blmsz) {
+        // name 中是打开时最后构造的 pathname 加上 4 个字符的后缀
+        if (fstat(db->idxfd, &statbuff) < 0) {
+            err_sys("db_bloom: fstat error");
+        }
+        len = strlen(db->name) - 4;
+        strcpy(db->name + len, ".blm");
+        if ((fd = open(db->name, O_RDWR | O_CREAT, statbuff.st_mode & 0777)) < 0) {
+            rc = -1;
+            goto doreturn;
+        }
+        if (db->bloom != NULL) {
+            munmap(db->bloom, BLMHDR_SZ + db->nhash * db->blmsz);
+            db->bloom = NULL;
+        }
+        rc = _db_bloom_map(db, fd, PROT_READ | PROT_WRITE, blmsz, 1);
+        close(fd);
+        if (rc < 0) {
+            goto doreturn;
+        }
+    }
+
+    // 在内存中建立新的过滤器: 遍历每条散列链, 把链上的键加入该链的过滤器
+    if ((bits = calloc(db->nhash, blmsz)) == NULL) {
+        err_dump("db_bloom: calloc error");
+    }
+    for (DBHASH i = 0; i < db->nhash; i++) {
+        offset = _db_readptr(db, db->hashoff + i * PTR_SZ);
+        while (offset != 0) {
+            offset = _db_readidx(db, offset);
+            _db_bloom_probe(bits + i * blmsz, blmsz, db->idxbuf, 1);
+        }
+    }
+
+    // 不加锁的 db_fetch 可能同时在读过滤器, 新旧过滤器都包含所有现存的键,
+    // 逐字节覆盖的过程中不会出现假阴性
+    memcpy(db->bloom + BLMHDR_SZ, bits, db->nhash * blmsz);
+    free(bits);
+
+doreturn:
+    if (_db_unlock(db->idxfd, 0, SEEK_SET, OPEN_OFF) < 0) {
+        err_dump("db_bloom: un_lock error");
+    }
+    _db_unlockall(db);
+    if (excl) {
+        _db_unlockexcl(db);
+    }
+    return rc;
+}
+
+static void _db_bloom_open(DB *db, int oflag, int init)
+{
+    int          fd, prot;
+    char         hdr[BLMHDR_SZ + 1], *ptr;
+    long         blmsz;
+    struct stat  statbuff;
+    struct flock lock;
+
+    // 新建数据库时建立并清空过滤器, 否则过滤器文件不存在就不使用.
+    // 调用者持有整个索引文件的写锁
+    prot = (oflag & O_ACCMODE) == O_RDONLY ? PROT_READ : PROT_READ | PROT_WRITE;
+    if (init) {
+        if ((fd = open(db->name, O_RDWR)) < 0) {
+            if (errno != ENOENT) {
+                err_sys("db_open: can't open %s", db->name);
+            }
+
+            // 其他句柄打开着没有过滤器的旧数据库时, 它们插入时不会设置过滤器的位,
+            // 这时不建立过滤器, 以后可以调用 db_bloom 建立
+            memset(&lock, 0, sizeof(lock));
+            lock.l_type = F_WRLCK;
+            lock.l_start = OPEN_OFF;
+            lock.l_whence = SEEK_SET;
+            lock.l_len = 1;
+            if (fcntl(db->idxfd, DB_GETLK, &lock) < 0) {
+                err_dump("db_open: fcntl error");
+            }
+            if (lock.l_type != F_UNLCK) {
+                return;
+            }
+            if (fstat(db->idxfd, &statbuff) < 0) {
+                err_sys("db_open: fstat error");
+            }
+            if ((fd = open(db->name, O_RDWR | O_CREAT, statbuff.st_mode & 0777)) < 0) {
+                err_sys("db_open: can't create %s", db->name);
+            }
+        }
+        if (_db_bloom_map(db, fd, prot, BLOOM_SZ, 1) < 0) {
+            err_sys("db_open: can't map %s", db->name);
+        }
+        close(fd);
+        return;
+    }
+
+    // 过滤器存在却打不开时不能忽略它, 否则这个句柄插入的键不会设置过滤器的位
+    if ((fd = open(db->name, (oflag & O_ACCMODE) == O_RDONLY ? O_RDONLY : O_RDWR)) < 0) {
+        if (errno != ENOENT) {
+            err_sys("db_open: can't open %s", db->name);
+        }
+        return;
+    }
+    if (fstat(fd, &statbuff) < 0) {
+        err_sys("db_open: fstat error");
+    }
+    hdr[BLMHDR_SZ] = 0;
+    if (_db_readn(fd, hdr, BLMHDR_SZ, 0) != BLMHDR_SZ || hdr[BLMHDR_SZ - 1] != NEWLINE ||
+        (blmsz = strtol(hdr, &ptr, 10)) <= 0 || blmsz > BLOOM_MAX || ptr != hdr + BLMHDR_SZ - 1 ||
+        statbuff.st_size != BLMHDR_SZ + db->nhash * blmsz) {
+        err_quit("db_open: %s does not match the hash table", db->name);
+    }
+    if (_db_bloom_map(db, fd, prot, blmsz, 0) < 0) {
+        err_sys("db_open: can't map %s", db->name);
+    }
+    close(fd);
+}
+
+static int _db_bloom_map(DB *db, int fd, int prot, size_t blmsz, int init)
+{
+    // 映射建立后就不再需要描述符, 由调用者关闭; 只读句柄只读取过滤器
+
+    char        hdr[BLMHDR_SZ + 1];
+    size_t      size = BLMHDR_SZ + db->nhash * blmsz;
+    struct stat statbuff;
+
+    if (init && (ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0)) {
+        return -1;
+    }
+    if ((db->bloom = mmap(NULL, size, prot, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        db->bloom = NULL;
+        return -1;
+    }
+    if (init) {
+        snprintf(hdr, sizeof(hdr), "%*d\n", BLMHDR_SZ - 1, (int)blmsz);
+        memcpy(db->bloom, hdr, BLMHDR_SZ);
+    }
+    if (fstat(fd, &statbuff) < 0) {
+        err_sys("_db_bloom_map: fstat error");
+    }
+    db->blmsz = blmsz;
+    db->blmino = statbuff.st_ino;
+    return 0;
+}
+
+static void _db_bloom_add(DB *db, const char *key)
+{
+    // 调用者持有该散列链的写锁, 同一链的过滤器不会被并发修改
+    if (db->bloom != NULL) {
+        _db_bloom_probe(db->bloom + BLMHDR_SZ + _db_hash(db, key) * db->blmsz, db->blmsz, key, 1);
+    }
+}
+
+static int _db_bloom_test(DB *db, const char *key)
+{
+    if (db->bloom == NULL) {
+        return 1;
+    }
+    return _db_bloom_probe(db->bloom + BLMHDR_SZ + _db_hash(db, key) * db->blmsz, db->blmsz, key, 0);
+}
+
+static int _db_bloom_probe(unsigned char *filter, size_t size, const char *key, int set)
+{
+    // FNV-1a 加 murmur3 的 fmix32 混合, 避免与 _db_hash 和 _db_shard 的结果相关,
+    // 再用双重散列从 hval 的高低两部分得到 BLOOM_K 个位置
+    unsigned int hval = 2166136261U, h2, bit;
+    int          found = 1;
+
+    while (*key != 0) {
+        hval ^= (unsigned char)*key++;
+        hval *= 16777619U;
+    }
+    hval ^= hval >> 16;
+    hval *= 0x85ebca6bU;
+    hval ^= hval >> 13;
+    hval *= 0xc2b2ae35U;
+    hval ^= hval >> 16;
+
+    h2 = (hval >> 16) | 1;
+    for (int i = 0; i < BLOOM_K; i++) {
+        bit = (hval + i * h2) % (size * 8);
+        if ((filter[bit >> 3] & (1 << (bit & 7))) == 0) {
+            found = 0;
+            if (!set) {
+                break;
+            }
+            filter[bit >> 3] |= 1 << (bit & 7);
+        }
+    }
+    return found;
+}
+
+int db_shm(DBHANDLE h)
+{
+    DB          *db = h;
+    int         fd, len, rc;
+    struct stat statbuff;
+
+    if (db->nshard > 0) {
+        for (int i = 0; i < db->nshard; i++) {
+            if (db_shm(db->shard[i]) < 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    if (db->shm != NULL) {
+        return 0;
+    }
+
+    // 其他句柄还在用记录锁锁定散列链, 只能在没有其他句柄打开数据库时建立
+    if (_db_lockexcl(db) < 0) {
+        return -1;
+    }
+    if (fstat(db->idxfd, &statbuff) < 0) {
+        err_sys("db_shm: fstat error");
+    }
+    len = strlen(db->name) - 4;
+    strcpy(db->name + len, ".shm");
+    rc = -1;
+    if ((fd = open(db->name, O_RDWR | O_CREAT, statbuff.st_mode & 0777)) >= 0) {
+        if ((rc = _db_shm_attach(db, fd)) < 0) {
+            close(fd);
+            unlink(db->name);
+        }
+    }
+    _db_unlockexcl(db);
+    return rc;
+}
+
+static int _db_shm_attach(DB *db, int fd)
+{
+    DBSHM               *shm;
+    size_t              size = sizeof(DBSHM) + db->nhash * sizeof(DBCHAIN);
+    int                 init, rc = -1;
+    struct flock        lock;
+    struct stat         statbuff;
+    pthread_mutexattr_t attr;
+
+    // 映射目录的句柄依次在 SHM_INIT_OFF 的写锁下检查 SHM_ATTACH_OFF 的读锁:
+    // 没有其他句柄持有它时, 目录中的锁和链首都不可信(所有句柄都已关闭, 进程崩溃或
+    // 系统重新启动), 根据索引文件重新建立目录; 检查和建立期间其他句柄在这里等待
+    if (_db_lockw(fd, F_WRLCK, SHM_INIT_OFF, SEEK_SET, 1) < 0) {
+        err_dump("_db_shm_attach: writew_lock error");
+    }
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_start = SHM_ATTACH_OFF;
+    lock.l_whence = SEEK_SET;
+    lock.l_len = 1;
+    if (fcntl(fd, DB_GETLK, &lock) < 0) {
+        err_dump("_db_shm_attach: fcntl error");
+    }
+    init = lock.l_type == F_UNLCK;
+
+    if (init && ftruncate(fd, size) < 0) {
+        goto doreturn;
+    }
+    if (fstat(fd, &statbuff) < 0) {
+        err_sys("_db_shm_attach: fstat error");
+    }
+    if (statbuff.st_size != size) {
+        errno = EINVAL;
+        goto doreturn;
+    }
+    if ((shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        goto doreturn;
+    }
+    db->shm = shm;
+    db->shmfd = fd;
+
+    if (init) {
+        // 锁必须是进程间共享的; robust 锁在持有者终止时交给下一个加锁者, 而不是永远锁住
+        if (pthread_mutexattr_init(&attr) != 0 ||
+            pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) != 0 ||
+            pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) != 0) {
+            err_dump("_db_shm_attach: pthread_mutexattr error");
+        }
+        memcpy(shm->magic, SHM_MAGIC, SHM_MAGIC_SZ);
+        shm->nhash = db->nhash;
+        for (DBHASH i = 0; i < db->nhash; i++) {
+            if (pthread_mutex_init(&shm->chain[i].lock, &attr) != 0) {
+                err_dump("_db_shm_attach: pthread_mutex_init error");
+            }
+        }
+        pthread_mutexattr_destroy(&attr);
+
+        // 对整个索引文件加读锁, 读到的链首不会是正在初始化的数据库的
+        if (_db_lockw(db->idxfd, F_RDLCK, 0, SEEK_SET, OPEN_OFF) < 0) {
+            err_dump("_db_shm_attach: readw_lock error");
+        }
+        if (fstat(db->idxfd, &statbuff) < 0) {
+            err_sys("_db_shm_attach: fstat error");
+        }
+        for (DBHASH i = 0; i < db->nhash; i++) {
+            if (statbuff.st_size >= db->recoff) {
+                _db_shm_reload(db, i);
+            } else {
+                shm->chain[i].head = 0;     // not initialized yet
+            }
+        }
+        if (_db_unlock(db->idxfd, 0, SEEK_SET, OPEN_OFF) < 0) {
+            err_dump("_db_shm_attach: un_lock error");
+        }
+    } else if (memcmp(shm->magic, SHM_MAGIC, SHM_MAGIC_SZ) != 0 || shm->nhash != db->nhash) {
+        err_quit("_db_shm_attach: %s does not match the hash table", db->name);
+    }
+
+    if (_db_lockw(fd, F_RDLCK, SHM_ATTACH_OFF, SEEK_SET, 1) < 0) {
+        err_dump("_db_shm_attach: readw_lock error");
+    }
+    rc = 0;
+
+doreturn:
+    if (_db_unlock(fd, SHM_INIT_OFF, SEEK_SET, 1) < 0) {
+        err_dump("_db_shm_attach: un_lock error");
+    }
+    return rc;
+}
+
+static void _db_shm_reload(DB *db, DBHASH i)
+{
+    char asciiptr[PTR_SZ + 1];
+
+    // 使用 pread, 不改变 idxfd 的当前偏移量
+    if (_db_readn(db->idxfd, asciiptr, PTR_SZ, db->hashoff + i * PTR_SZ) != PTR_SZ) {
+        err_dump("_db_shm_reload: read error of ptr field");
+    }
+    asciiptr[PTR_SZ] = 0;
+    db->shm->chain[i].head = atol(asciiptr);
+}
+
+static void _db_lockchain(DB *db, off_t chainoff, int writelock)
+{
+    DBHASH i;
+    int    rc;
+
+    if (db->shm == NULL) {
+        if (writelock) {
+            if (_db_lockw(db->idxfd, F_WRLCK, chainoff, SEEK_SET, 1) < 0) {
+                err_dump("_db_lockchain: writew_lock error");
+            }
+        } else {
+            if (_db_lockw(db->idxfd, F_RDLCK, chainoff, SEEK_SET, 1) < 0) {
+                err_dump("_db_lockchain: readw_lock error");
+            }
+        }
+        return;
+    }
+
+    // 互斥量不区分读写, 读同一散列链的进程也相互排斥;
+    // 没有竞争时加锁只是一次原子操作, 不进入内核
+    i = (chainoff - db->hashoff) / PTR_SZ;
+    if ((rc = pthread_mutex_lock(&db->shm->chain[i].lock)) == EOWNERDEAD) {
+        // 持有锁的进程在修改散列链时终止, 它可能已经写了索引文件但没有更新目录
+        _db_shm_reload(db, i);
+        if (pthread_mutex_consistent(&db->shm->chain[i].lock) != 0) {
+            err_dump("_db_lockchain: pthread_mutex_consistent error");
+        }
+    } else if (rc != 0) {
+        errno = rc;
+        err_dump("_db_lockchain: pthread_mutex_lock error");
+    }
+}
+
+static void _db_unlockchain(DB *db, off_t chainoff)
+{
+    if (db->shm == NULL) {
+        if (_db_unlock(db->idxfd, chainoff, SEEK_SET, 1) < 0) {
+            err_dump("_db_unlockchain: un_lock error");
+        }
+    } else if (pthread_mutex_unlock(&db->shm->chain[(chainoff - db->hashoff) / PTR_SZ].lock) != 0) {
+        err_dump("_db_unlockchain: pthread_mutex_unlock error");
+    }
+}
+
+static void _db_lockall(DB *db)
+{
+    if (db->shm != NULL) {
+        for (DBHASH i = 0; i < db->nhash; i++) {
+            _db_lockchain(db, db->hashoff + i * PTR_SZ, 1);
+        }
+    }
+}
+
+static void _db_unlockall(DB *db)
+{
+    if (db->shm != NULL) {
+        for (DBHASH i = db->nhash; i > 0; i--) {
+            _db_unlockchain(db, db->hashoff + (i - 1) * PTR_SZ);
+        }
+    }
+}
+
+int db_compress(DBHANDLE h, const char **samples, int nsample, int threshold)
+{
+    DB          *db = h;
+    char        dict[DICT_MAX], hdr[DICT_MAGIC_SZ + 2 * DICT_LEN_SZ + 2];
+    int         i, rc;
+    size_t      dictlen, n;
+    struct stat statbuff;
+
+    if (db->nshard > 0) {
+        for (i = 0; i < db->nshard; i++) {
+            if ((rc = db_compress(db->shard[i], samples, nsample, threshold)) < 0) {
+                return rc;
+            }
+        }
+        return 0;
+    }
+    if (threshold < 0 || threshold > DATLEN_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    dictlen = _db_train(samples, nsample, dict, DICT_MAX);
+
+    // 其他句柄只在打开时读入字典, 看不到新的字典, 所以只能在没有其他句柄打开数据库时启用.
+    // 字典保存在数据文件的头部, 所以只能对空数据库启用压缩
+    if (_db_lockexcl(db) < 0) {
+        return -1;
+    }
+    if (_db_lockw(db->datfd, F_WRLCK, 0, SEEK_SET, 0) < 0) {
+        err_dump("db_compress: writew_lock error");
+    }
+    if (fstat(db->datfd, &statbuff) < 0) {
+        err_sys("db_compress: fstat error");
+    }
+    if (statbuff.st_size != 0) {
+        errno = ENOTEMPTY;
+        rc = -1;
+    } else {
+        sprintf(hdr, "%s%*d%*d\n", DICT_MAGIC, DICT_LEN_SZ, threshold, DICT_LEN_SZ, (int)dictlen);
+        n = strlen(hdr);
+        if (lseek(db->datfd, 0, SEEK_SET) == -1) {
+            err_dump("db_compress: lseek error");
+        }
+        if (_db_writen(db->datfd, hdr, n, -1) != n ||
+            _db_writen(db->datfd, dict, dictlen, -1) != dictlen ||
+            _db_writen(db->datfd, "\n", 1, -1) != 1) {
+            err_dump("db_compress: write error of dictionary");
+        }
+        _db_loaddict(db);
+        rc = 0;
+    }
+    if (_db_unlock(db->datfd, 0, SEEK_SET, 0) < 0) {
+        err_dump("db_compress: un_lock error");
+    }
+    _db_unlockexcl(db);
+    return rc;
+}
+
+double db_cmpratio(DBHANDLE h)
+{
+    DB    *db = h;
+    COUNT in, out;
+
+    in = db->cnt_cmpin;
+    out = db->cnt_cmpout;
+    for (int i = 0; i < db->nshard; i++) {
+        in += db->shard[i]->cnt_cmpin;
+        out += db->shard[i]->cnt_cmpout;
+    }
+    return out == 0 ? 1.0 : (double)in / out;
+}
+
+static void _db_loaddict(DB *db)
+{
+    // 数据文件以 DICT_MAGIC 开头时, 读入字典并分配压缩用的缓冲区
+
+    char   hdr[DICT_MAGIC_SZ + 2 * DICT_LEN_SZ + 2], asciilen[DICT_LEN_SZ + 1];
+    size_t i, n;
+
+    if (lseek(db->datfd, 0, SEEK_SET) == -1) {
+        err_dump("_db_loaddict: lseek error");
+    }
+    n = DICT_MAGIC_SZ + 2 * DICT_LEN_SZ + 1;
+    if (_db_readn(db->datfd, hdr, n, -1) != n || memcmp(hdr, DICT_MAGIC, DICT_MAGIC_SZ) != 0) {
+        return;     // not compressed
+    }
+
+    memcpy(asciilen, hdr + DICT_MAGIC_SZ, DICT_LEN_SZ);
+    asciilen[DICT_LEN_SZ] = 0;
+    db->cmpmin = atoi(asciilen);
+    memcpy(asciilen, hdr + DICT_MAGIC_SZ + DICT_LEN_SZ, DICT_LEN_SZ);
+    db->dictlen = atoi(asciilen);
+    if (db->dictlen > DICT_MAX || hdr[n - 1] != NEWLINE) {
+        err_dump("_db_loaddict: invalid dictionary header");
+    }
+
+    // cmpbuf 存放字典, 紧接着字典的是压缩和解压缩用的窗口, 匹配可以引用字典中的内容
+    if (db->cmpbuf == NULL) {
+        if ((db->cmpbuf = malloc(DICT_MAX + DATLEN_MAX + 2)) == NULL ||
+            (db->dicthash = malloc(LZ_HASHSZ * sizeof(unsigned short))) == NULL) {
+            err_dump("_db_loaddict: malloc error for compression buffers");
+        }
+    }
+    if (_db_readn(db->datfd, db->cmpbuf, db->dictlen, -1) != db->dictlen) {
+        err_dump("_db_loaddict: read error of dictionary");
+    }
+
+    // 预先计算字典中每个位置的散列, 每次压缩时复制这张表即可
+    memset(db->dicthash, 0, LZ_HASHSZ * sizeof(unsigned short));
+    for (i = 0; i + LZ_MINMATCH <= db->dictlen; i++) {
+        db->dicthash[_db_lzhash(db->cmpbuf + i)] = i + 1;
+    }
+}
+
+static size_t _db_train(const char **samples, int nsample, char *dict, size_t max)
+{
+    // 训练字典: 将样本切成 LZ_SEGSZ 字节的片段, 按片段中各个4字节序列在所有样本中
+    // 出现的次数为片段打分, 得分最高的片段放在字典的末尾, 离被压缩的数据最近
+
+    unsigned int *count;
+    struct segment { const char *ptr; size_t len; unsigned long score; } *seg, tmp;
+    size_t       i, j, k, n, nseg, len, dictlen;
+
+    if ((count = calloc(LZ_HASHSZ, sizeof(unsigned int))) == NULL) {
+        err_dump("_db_train: calloc error");
+    }
+    for (nseg = 0, i = 0; i < nsample; i++) {
+        len = strlen(samples[i]);
+        for (j = 0; j + LZ_MINMATCH <= len; j++) {
+            count[_db_lzhash(samples[i] + j)]++;
+        }
+        nseg += (len + LZ_SEGSZ - 1) / LZ_SEGSZ;
+    }
+    if ((seg = malloc((nseg + 1) * sizeof(*seg))) == NULL) {
+        err_dump("_db_train: malloc error");
+    }
+
+    for (n = 0, i = 0; i < nsample; i++) {
+        len = strlen(samples[i]);
+        for (j = 0; j < len; j += LZ_SEGSZ) {
+            seg[n].ptr = samples[i] + j;
+            seg[n].len = len - j < LZ_SEGSZ ? len - j : LZ_SEGSZ;
+            seg[n].score = 0;
+            for (k = 0; k + LZ_MINMATCH <= seg[n].len; k++) {
+                seg[n].score += count[_db_lzhash(seg[n].ptr + k)];
+            }
+            n++;
+        }
+    }
+
+    // 按得分从低到高插入排序后, 从高分开始从字典末尾向前填充, 相同的片段只保留一份
+    for (i = 1; i < n; i++) {
+        tmp = seg[i];
+        for (j = i; j > 0 && seg[j - 1].score > tmp.score; j--) {
+            seg[j] = seg[j - 1];
+        }
+        seg[j] = tmp;
+    }
+    dictlen = 0;
+    for (i = n; i > 0 && dictlen < max; i--) {
+        len = seg[i - 1].len;
+        if (seg[i - 1].score <= len || len > max - dictlen) {
+            continue;       // segment seen only once, or too long
+        }
+        for (k = max - dictlen; k + len <= max; k++) {
+            if (memcmp(dict + k, seg[i - 1].ptr, len) == 0) {
+                break;
+            }
+        }
+        if (k + len <= max) {
+            continue;       // already in dictionary
+        }
+        dictlen += len;
+        memcpy(dict + max - dictlen, seg[i - 1].ptr, len);
+    }
+    memmove(dict, dict + max - dictlen, dictlen);
+
+    free(seg);
+    free(count);
+    return dictlen;
+}
+
+static const char *_db_encode(DB *db, const char *data, time_t expire, size_t *lenp)
+{
+    // 有过期时间的记录以 EXP_MARK 和过期时间开头, 本身以 EXP_MARK 开头的值
+    // 也加上(值为0的)过期时间, 以免混淆.
+    // 压缩数据库中, 此后是一个字节的标记 CMP_RAW 或 CMP_LZ.
+    // 其余情况直接写入原始数据
+
+    size_t len, n, hdr, max;
+
+    len = strlen(data);
+    hdr = 0;
+    if (expire != 0 || data[0] == EXP_MARK) {
+        sprintf(db->encbuf, "%c%*lld", EXP_MARK, EXP_SZ, (long long)expire);
+        hdr = EXP_HDR_SZ;
+    }
+    if (db->cmpbuf == NULL) {
+        if (hdr == 0) {
+            *lenp = len;
+            return data;
+        }
+        if (hdr + len + 1 > DATLEN_MAX) {
+            err_dump("db_store: invalid data length");
+        }
+        memcpy(db->encbuf + hdr, data, len);
+        *lenp = hdr + len;
+        return db->encbuf;
+    }
+
+    db->cnt_cmpin += len;
+    n = 0;
+    if (len >= db->cmpmin && len <= DATLEN_MAX) {
+        // data 可能正是上一次 db_fetch 返回的窗口, 所以用 memmove
+        memmove(db->cmpbuf + db->dictlen, data, len);
+        max = len - 1 < DATLEN_MAX - hdr - 2 ? len - 1 : DATLEN_MAX - hdr - 2;
+        n = _db_lzenc(db, len, db->encbuf + hdr + 1, max);
+    }
+    if (n == 0) {
+        // 太短或压缩后没有变小, 保存原始数据
+        if (hdr + len + 2 > DATLEN_MAX) {
+            err_dump("db_store: invalid data length");
+        }
+        db->encbuf[hdr] = CMP_RAW;
+        memcpy(db->encbuf + hdr + 1, data, len);
+        n = len;
+    } else {
+        db->encbuf[hdr] = CMP_LZ;
+    }
+    db->cnt_cmpout += n + 1;
+    *lenp = hdr + n + 1;
+    return db->encbuf;
+}
+
+static char *_db_decode(DB *db, char *rec, size_t len)
+{
+    char    *out;
+    ssize_t n;
+
+    if (len == 0 || rec[0] == CMP_RAW) {
+        return rec + 1;
+    }
+    if (rec[0] != CMP_LZ) {
+        err_dump("_db_decode: invalid record tag");
+    }
+    out = db->cmpbuf + db->dictlen;
+    if ((n = _db_lzdec(db, rec + 1, len - 1, DATLEN_MAX)) < 0) {
+        err_dump("_db_decode: corrupt compressed record");
+    }
+    out[n] = 0;
+    return out;
+}
+
+static unsigned int _db_lzhash(const char *p)
+{
+    unsigned int v;
+
+    v = (unsigned char)p[0] | (unsigned char)p[1] << 8 |
+        (unsigned char)p[2] << 16 | (unsigned int)(unsigned char)p[3] << 24;
+    return (v * 2654435761U) >> (32 - LZ_HASHBITS);
+}
+
+static size_t _db_lzenc(DB *db, size_t len, char *out, size_t max)
+{
+    // 压缩窗口中字典之后的 len 个字节, 输出由两种命令组成:
+    //   0x00-0x7f: 之后有 (命令 + 1) 个原样复制的字节
+    //   0x80-0xff: 复制 (命令 - 0x80 + LZ_MINMATCH) 个字节, 之后2个字节是向前的距离
+    // 输出超过 max 字节时返回0, 表示不值得压缩
+
+    unsigned short htab[LZ_HASHSZ];
+    const char     *win = db->cmpbuf;
+    size_t         i, end, lit, cand, mlen, n, o;
+    unsigned int   h;
+
+    memcpy(htab, db->dicthash, sizeof(htab));
+    i = lit = db->dictlen;
+    end = db->dictlen + len;
+    o = 0;
+    while (i + LZ_MINMATCH <= end) {
+        h = _db_lzhash(win + i);
+        cand = htab[h];
+        htab[h] = i + 1;
+        if (cand == 0 || i - (cand - 1) > 0xffff || memcmp(win + cand - 1, win + i, LZ_MINMATCH) != 0) {
+            i++;
+            continue;
+        }
+        cand--;
+        for (mlen = LZ_MINMATCH; i + mlen < end && mlen < LZ_MAXMATCH && win[cand + mlen] == win[i + mlen]; mlen++)
+            ;
+
+        // 先输出匹配之前的原样字节
+        for (; lit < i; lit += n) {
+            n = i - lit < 0x80 ? i - lit : 0x80;
+            if (o + 1 + n > max) {
+                return 0;
+            }
+            out[o++] = n - 1;
+            memcpy(out + o, win + lit, n);
+            o += n;
+        }
+        if (o + 3 > max) {
+            return 0;
+        }
+        out[o++] = 0x80 | (mlen - LZ_MINMATCH);
+        out[o++] = (i - cand) >> 8;
+        out[o++] = (i - cand) & 0xff;
+        i += mlen;
+        lit = i;
+    }
+    for (; lit < end; lit += n) {
+        n = end - lit < 0x80 ? end - lit : 0x80;
+        if (o + 1 + n > max) {
+            return 0;
+        }
+        out[o++] = n - 1;
+        memcpy(out + o, win + lit, n);
+        o += n;
+    }
+    return o;
+}
+
+static ssize_t _db_lzdec(DB *db, const char *in, size_t len, size_t max)
+{
+    // 解压缩到窗口中字典之后的位置, 返回解压后的长度, 数据有误时返回-1
+
+    char   *win = db->cmpbuf;
+    size_t i, o, n, dist, start;
+
+    start = o = db->dictlen;
+    for (i = 0; i < len; ) {
+        n = (unsigned char)in[i++];
+        if (n < 0x80) {
+            n++;
+            if (i + n > len || o - start + n > max) {
+                return -1;
+            }
+            memcpy(win + o, in + i, n);
+            i += n;
+        } else {
+            n = n - 0x80 + LZ_MINMATCH;
+            if (i + 2 > len) {
+                return -1;
+            }
+            dist = (unsigned char)in[i] << 8 | (unsigned char)in[i + 1];
+            i += 2;
+            if (dist == 0 || dist > o || o - start + n > max) {
+                return -1;
+            }
+            for (size_t k = 0; k < n; k++) {    // may overlap
+                win[o + k] = win[o - dist + k];
+            }
+        }
+        o += n;
+    }
+    return o - start;
+}
+
+int db_expire(DBHANDLE h, int max)
+{
+    // 回收最多 max 条已过期的记录, 放入空闲链表
+
+    DB          *db = h;
+    DBEXP       *ent, *keep, e;
+    char        key[IDXLEN_MAX + 1];
+    off_t       cursor, target, head, garbage, off;
+    int         i, n, done, nent, maxent, nkeep, maxkeep, nsurplus;
+    size_t      freed;
+    time_t      now;
+    struct stat statbuff;
+
+    if (db->nshard > 0) {
+        for (n = 0, i = 0; i < db->nshard && n < max; i++) {
+            n += db_expire(db->shard[i], max - n);
+        }
+        return n;
+    }
+    if (max <= 0 || _db_expopen(db, 0) < 0) {
+        return 0;       // nothing was ever stored with a TTL
+    }
+
+    // 扫描期间一直持有 EXPSWEEP_OFF 的锁, 同时只有一个进程读取和整理链表.
+    // 添加条目的进程只在摘下链表和移动游标的很短时间内等待
+    if (_db_lockw(db->expfd, F_WRLCK, EXPSWEEP_OFF, SEEK_SET, 1) < 0) {
+        err_dump("db_expire: writew_lock error");
+    }
+
+    // 从游标开始, 到整个时间段都已过去的最后一个桶, 这些桶的链表中的条目都已过期,
+    // 只是同一链表中还有转了一圈以后才过期的条目. 逐个桶摘下链表, 在锁外读它的条目:
+    // 已过期的取出最多 max 条, 其余的暂存在 keep 中
+    now = time(NULL);
+    target = (now + 1) / EXPB_W;
+    ent = keep = NULL;
+    nent = maxent = nkeep = maxkeep = nsurplus = 0;
+    freed = 0;
+    for (done = 0; !done; ) {
+        if (_db_lockw(db->expfd, F_WRLCK, EXPCUR_OFF, SEEK_SET, 1) < 0) {
+            err_dump("db_expire: writew_lock error");
+        }
+        cursor = _db_expcursor(db);
+        if (target - cursor > EXPB_N) {
+            cursor = target - EXPB_N;       // at most once around the wheel
+        }
+
+        // 摘空了的桶(在读的时候可能又加入了条目), 游标才能越过它,
+        // 然后放回从中读出的还没有过期的条目, 它们属于以后的桶
+        head = 0;
+        while (cursor < target && nsurplus == 0 &&
+               (head = _db_expreadptr(db, EXPHEAD_OFF + cursor % EXPB_N * EXPPTR_SZ)) == 0) {
+            cursor++;
+            _db_expwriteptr(db, EXPCUR_OFF, cursor);
+            for (i = 0; i < nkeep; i++) {
+                _db_explink(db, cursor, keep[i].key, keep[i].expire);
+                free(keep[i].key);
+            }
+            nkeep = 0;
+        }
+        _db_expwriteptr(db, EXPCUR_OFF, cursor);
+        if (cursor < target && head != 0 && nent < max) {
+            _db_expwriteptr(db, EXPHEAD_OFF + cursor % EXPB_N * EXPPTR_SZ, 0);
+        } else {
+            // 取够了 max 条时游标停在这个桶, 多出的已过期条目放回这个桶, 下次先回收.
+            // 摘下的条目都成为垃圾, 垃圾比存活的条目多时整理文件
+            for (i = 0; i < nkeep; i++) {
+                _db_explink(db, cursor, keep[i].key, keep[i].expire);
+                free(keep[i].key);
+            }
+            garbage = _db_expreadptr(db, EXPGARB_OFF) + freed;
+            if (fstat(db->expfd, &statbuff) < 0) {
+                err_sys("db_expire: fstat error");
+            }
+            if (garbage > statbuff.st_size - EXPHDR_SZ - garbage && statbuff.st_size > 2 * EXPHDR_SZ) {
+                _db_expcompact(db);
+            } else {
+                _db_expwriteptr(db, EXPGARB_OFF, garbage);
+            }
+            done = 1;
+        }
+        if (_db_unlock(db->expfd, EXPCUR_OFF, SEEK_SET, 1) < 0) {
+            err_dump("db_expire: un_lock error");
+        }
+
+        // 条目一旦写入就不再修改, 读摘下的链表时不需要对游标加锁
+        for (off = done ? 0 : head; off != 0 && _db_expread(db, off, &e, key) == 0; off = e.next) {
+            freed += e.len;
+            if (e.expire <= now && nent < max) {
+                if (nent == maxent) {
+                    maxent = maxent == 0 ? 64 : maxent * 2;
+                    if ((ent = realloc(ent, maxent * sizeof(DBEXP))) == NULL) {
+                        err_dump("db_expire: realloc error");
+                    }
+                }
+                e.key = ent[nent].key = strdup(key);
+                ent[nent++].expire = e.expire;
+            } else {
+                if (nkeep == maxkeep) {
+                    maxkeep = maxkeep == 0 ? 64 : maxkeep * 2;
+                    if ((keep = realloc(keep, maxkeep * sizeof(DBEXP))) == NULL) {
+                        err_dump("db_expire: realloc error");
+                    }
+                }
+                e.key = keep[nkeep].key = strdup(key);
+                keep[nkeep++].expire = e.expire;
+                nsurplus += e.expire <= now;
+            }
+            if (e.key == NULL) {
+                err_dump("db_expire: strdup error");
+            }
+        }
+    }
+    if (_db_unlock(db->expfd, EXPSWEEP_OFF, SEEK_SET, 1) < 0) {
+        err_dump("db_expire: un_lock error");
+    }
+    free(keep);
+
+    // 逐条加锁删除. 记录可能已被重新存入(没有过期时间或新的过期时间), 所以要再检查一次.
+    // 推迟了过期时间的记录存入时没有添加条目(见 _db_expneed), 在这里按新的过期时间放回
+    for (n = 0, i = 0; i < nent; i++) {
+        if (_db_find_and_lock(db, ent[i].key, 1) == 0) {
+            if (_db_expired(db)) {
+                _db_dodelete(db);
+                _db_log(db, LOG_DELETE, ent[i].key, NULL, 0, 0);
+                db->cnt_expired++;
+                n++;
+            } else if (db->expire > ent[i].expire) {
+                _db_expadd(db, ent[i].key, db->expire);
+            }
+        }
+        _db_unlockchain(db, db->chainoff);
+        free(ent[i].key);
+    }
+    free(ent);
+    return n;
+}
+
+static int _db_expneed(time_t oldexp, time_t expire)
+{
+    // 刷新过期时间时, 原来的条目还在过期索引中(oldexp 是没有过期的原记录的过期时间,
+    // 没有则为 0). 新的过期时间不早于它时不再添加条目, 以免过期索引随每次刷新增长,
+    // db_expire 在原来的时间处理这个条目时发现记录没有过期, 再按新的时间放回
+    return expire != 0 && (oldexp == 0 || expire < oldexp);
+}
+
+static void _db_expadd(DB *db, const char *key, time_t expire)
+{
+    // 在过期索引中添加一个条目, 第一次使用时建立过期索引
+
+    _db_expopen(db, 1);
+    if (_db_lockw(db->expfd, F_WRLCK, EXPCUR_OFF, SEEK_SET, 1) < 0) {
+        err_dump("_db_expadd: writew_lock error");
+    }
+    _db_explink(db, _db_expcursor(db), key, expire);
+    if (_db_unlock(db->expfd, EXPCUR_OFF, SEEK_SET, 1) < 0) {
+        err_dump("_db_expadd: un_lock error");
+    }
+}
+
+static void _db_explink(DB *db, off_t cursor, const char *key, time_t expire)
+{
+    // 把 "prev expire key" 追加到过期索引的末尾, 放在过期时间所在的桶的链表头部.
+    // 游标已经越过的桶不会再被扫描, 过期时间更早的条目放在游标所在的桶
+
+    char        buf[EXPENT_MAX + 1];
+    off_t       bucket, headoff;
+    size_t      len;
+    struct stat statbuff;
+
+    bucket = expire / EXPB_W < cursor ? cursor : expire / EXPB_W;
+    headoff = EXPHEAD_OFF + bucket % EXPB_N * EXPPTR_SZ;
+    len = sprintf(buf, "%*lld%c%*lld%c%s\n", EXPPTR_SZ, (long long)_db_expreadptr(db, headoff),
+                  SPACE, EXP_SZ, (long long)expire, SPACE, key);
+
+    // 先写条目, 再修改链表头, 中途终止的进程只留下一条不在链表中的垃圾
+    if (fstat(db->expfd, &statbuff) < 0) {
+        err_sys("_db_explink: fstat error");
+    }
+    if (_db_writen(db->expfd, buf, len, statbuff.st_size) != len) {
+        err_dump("_db_explink: write error");
+    }
+    _db_expwriteptr(db, headoff, statbuff.st_size);
+}
+
+static int _db_expopen(DB *db, int create)
+{
+    int         len;
+    struct stat statbuff;
+
+    if (db->expfd >= 0) {
+        return 0;
+    }
+
+    // name 中是打开时最后构造的 pathname 加上 4 个字符的后缀
+    if (fstat(db->idxfd, &statbuff) < 0) {
+        err_sys("_db_expopen: fstat error");
+    }
+    len = strlen(db->name) - 4;
+    strcpy(db->name + len, ".exp");
+    if ((db->expfd = open(db->name, O_RDWR | (create ? O_CREAT : 0), statbuff.st_mode & 0777)) < 0) {
+        if (create) {
+            err_sys("_db_expopen: can't create %s", db->name);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static off_t _db_expcursor(DB *db)
+{
+    // 调用者持有游标的锁. 刚建立的过期索引还是空的, 由第一个加锁的进程写入头部,
+    // 游标从当前时间所在的桶开始
+
+    char    *hdr, asciiptr[EXPPTR_SZ + 1];
+    off_t   cursor;
+    ssize_t len;
+
+    if ((len = _db_readn(db->expfd, asciiptr, EXPPTR_SZ, EXPCUR_OFF)) == EXPPTR_SZ) {
+        asciiptr[EXPPTR_SZ] = 0;
+        return atoll(asciiptr);
+    }
+    if (len != 0) {
+        err_dump("_db_expcursor: read error of expiry index header");
+    }
+    if ((hdr = malloc(EXPHDR_SZ + 1)) == NULL) {
+        err_dump("_db_expcursor: malloc error");
+    }
+    cursor = time(NULL) / EXPB_W;
+    len = sprintf(hdr, "%*lld%c%*d%c", EXPPTR_SZ, (long long)cursor, SPACE, EXPPTR_SZ, 0, SPACE);
+    for (int i = 0; i < EXPB_N; i++) {
+        len += sprintf(hdr + len, "%*d", EXPPTR_SZ, 0);
+    }
+    hdr[len++] = NEWLINE;
+    if (_db_writen(db->expfd, hdr, len, 0) != len) {
+        err_dump("_db_expcursor: write error of header");
+    }
+    free(hdr);
+    return cursor;
+}
+
+static off_t _db_expreadptr(DB *db, off_t offset)
+{
+    char asciiptr[EXPPTR_SZ + 1];
+
+    if (_db_readn(db->expfd, asciiptr, EXPPTR_SZ, offset) != EXPPTR_SZ) {
+        err_dump("_db_expreadptr: read error of expiry index header");
+    }
+    asciiptr[EXPPTR_SZ] = 0;
+    return atoll(asciiptr);
+}
+
+static void _db_expwriteptr(DB *db, off_t offset, off_t ptrval)
+{
+    char asciiptr[EXPPTR_SZ + 1];
+
+    if (ptrval < 0 || snprintf(asciiptr, sizeof(asciiptr), "%*lld", EXPPTR_SZ, (long long)ptrval) != EXPPTR_SZ) {
+        err_quit("_db_expwriteptr: invalid ptr: %lld", (long long)ptrval);
+    }
+    if (_db_writen(db->expfd, asciiptr, EXPPTR_SZ, offset) != EXPPTR_SZ) {
+        err_dump("_db_expwriteptr: write error of expiry index header");
+    }
+}
+
+static int _db_expread(DB *db, off_t offset, DBEXP *e, char *key)
+{
+    // 条目有误(整理文件时进程终止)时返回 -1, 这个链表的其余条目被丢弃,
+    // 它们的记录仍然对读者不可见, 只是不再由 db_expire 回收
+
+    char    buf[EXPENT_MAX + 1], *nl;
+    ssize_t n;
+
+    if (offset < EXPHDR_SZ ||
+        (n = _db_readn(db->expfd, buf, EXPENT_MAX, offset)) < EXPPTR_SZ + EXP_SZ + 4 ||
+        (nl = memchr(buf, NEWLINE, n)) == NULL || nl - buf < EXPPTR_SZ + EXP_SZ + 3) {
+        return -1;
+    }
+    *nl = 0;
+    buf[EXPPTR_SZ] = 0;
+    buf[EXPPTR_SZ + 1 + EXP_SZ] = 0;
+    e->next = atoll(buf);
+    e->expire = atoll(buf + EXPPTR_SZ + 1);
+    e->len = nl - buf + 1;
+    strcpy(key, buf + EXPPTR_SZ + EXP_SZ + 2);
+    e->key = key;
+    return 0;
+}
+
+static void _db_expcompact(DB *db)
+{
+    // 把每个链表的条目按原来的顺序紧凑地写到头部之后, 然后截断文件.
+    // 其他进程还打开着原来的文件, 所以不能写新文件再改名
+
+    char        *buf, *out, *ptr, *nl, asciiptr[EXP_SZ + 1];
+    off_t       *offs, off;
+    size_t      len, size, maxoff, n;
+    int         i;
+    struct stat statbuff;
+
+    if (fstat(db->expfd, &statbuff) < 0) {
+        err_sys("_db_expcompact: fstat error");
+    }
+    size = statbuff.st_size;
+    maxoff = size / (EXPPTR_SZ + EXP_SZ + 4) + 1;     // shortest entry
+    if ((buf = malloc(size + 1)) == NULL || (out = malloc(size + 1)) == NULL ||
+        (offs = malloc(maxoff * sizeof(off_t))) == NULL) {
+        err_dump("_db_expcompact: malloc error");
+    }
+    if (_db_readn(db->expfd, buf, size, 0) != size) {
+        err_dump("_db_expcompact: read error");
+    }
+    buf[size] = 0;
+    memcpy(out, buf, EXPHDR_SZ);
+    len = EXPHDR_SZ;
+
+    // 先找到链表中的所有条目, 再从尾部开始写, 每个条目指向刚写过的条目
+    for (i = 0; i < EXPB_N; i++) {
+        memcpy(asciiptr, buf + EXPHEAD_OFF + i * EXPPTR_SZ, EXPPTR_SZ);
+        asciiptr[EXPPTR_SZ] = 0;
+        for (n = 0, off = atoll(asciiptr); off >= EXPHDR_SZ && off < size && n < maxoff; n++) {
+            if ((nl = memchr(buf + off, NEWLINE, size - off)) == NULL ||
+                nl - buf - off < EXPPTR_SZ + EXP_SZ + 3) {
+                break;      // torn entry
+            }
+            offs[n] = off;
+            memcpy(asciiptr, buf + off, EXPPTR_SZ);
+            asciiptr[EXPPTR_SZ] = 0;
+            off = atoll(asciiptr);
+        }
+        for (off = 0; n > 0; n--) {
+            ptr = buf + offs[n - 1];
+            nl = memchr(ptr, NEWLINE, buf + size - ptr);
+            sprintf(asciiptr, "%*lld", EXPPTR_SZ, (long long)off);
+            memcpy(out + len, asciiptr, EXPPTR_SZ);
+            memcpy(out + len + EXPPTR_SZ, ptr + EXPPTR_SZ, nl - ptr - EXPPTR_SZ + 1);
+            off = len;
+            len += nl - ptr + 1;
+        }
+        sprintf(asciiptr, "%*lld", EXPPTR_SZ, (long long)off);
+        memcpy(out + EXPHEAD_OFF + i * EXPPTR_SZ, asciiptr, EXPPTR_SZ);
+    }
+    sprintf(asciiptr, "%*d", EXPPTR_SZ, 0);
+    memcpy(out + EXPGARB_OFF, asciiptr, EXPPTR_SZ);
+
+    if (_db_writen(db->expfd, out, len, 0) != len) {
+        err_dump("_db_expcompact: write error");
+    }
+    if (ftruncate(db->expfd, len) < 0) {
+        err_dump("_db_expcompact: ftruncate error");
+    }
+    free(offs);
+    free(out);
+    free(buf);
+}
+
+static int _db_expired(DB *db)
+{
+    // 只读数据记录开头的过期时间, 判断 _db_find 找到的记录是否已过期
+
+    char buf[EXP_HDR_SZ];
+
+    db->expire = 0;
+    if (db->datlen < EXP_HDR_SZ + 1) {
+        return 0;
+    }
+    if (_db_readn(db->datfd, buf, EXP_HDR_SZ, db->datoff) != EXP_HDR_SZ) {
+        err_dump("_db_expired: read error");
+    }
+    if (buf[0] != EXP_MARK) {
+        return 0;
+    }
+    db->expire = _db_getexpire(buf);
+    return db->expire != 0 && db->expire <= time(NULL);
+}
+
+static time_t _db_getexpire(const char *ptr)
+{
+    // ptr 指向 EXP_MARK, 其后是 EXP_SZ 个字符的过期时间
+
+    char asciiexp[EXP_SZ + 1];
+
+    memcpy(asciiexp, ptr + 1, EXP_SZ);
+    asciiexp[EXP_SZ] = 0;
+    return atoll(asciiexp);
+}
+
+int db_feed(DBHANDLE h)
+{
+    DB          *db = h, **dbs;
+    char        hdr[FEEDHDR_SZ + 1];
+    int         i, n, len, rc;
+    struct stat statbuff;
+
+    if (db->logfd >= 0) {
+        return 0;
+    }
+
+    // 句柄只在打开时查看变更流是否存在, 之前打开的句柄不会记录修改,
+    // 所以只能在没有其他句柄打开数据库(的任何分片)时开启变更流
+    if (db->nshard > 0) {
+        dbs = db->shard;
+        n = db->nshard;
+    } else {
+        dbs = &db;
+        n = 1;
+    }
+    for (i = 0; i < n; i++) {
+        if (_db_lockexcl(dbs[i]) < 0) {
+            break;
+        }
+    }
+    rc = i < n ? -1 : 0;
+    if (rc < 0) {
+        goto doreturn;
+    }
+
+    // 顶层的 name 是分片数据库的目录名; 否则是打开时最后构造的 pathname 加上后缀
+    if (fstat(dbs[0]->idxfd, &statbuff) < 0) {
+        err_sys("db_feed: fstat error");
+    }
+    len = strlen(db->name);
+    if (db->nshard > 0) {
+        sprintf(db->name + len, "/%s.log", FEED_NAME);
+    } else {
+        strcpy(db->name + len - 4, ".log");
+    }
+    db->logfd = open(db->name, O_RDWR | O_CREAT, statbuff.st_mode & 0777);
+    if (db->nshard > 0) {
+        db->name[len] = 0;
+    }
+    if (db->logfd < 0) {
+        rc = -1;
+        goto doreturn;
+    }
+
+    // 变更流以下一个序列号和已提交的长度开头, 只有第一个建立它的进程写入
+    if (_db_lockw(db->logfd, F_WRLCK, 0, SEEK_SET, FEEDHDR_SZ) < 0) {
+        err_dump("db_feed: writew_lock error");
+    }
+    if (fstat(db->logfd, &statbuff) < 0) {
+        err_sys("db_feed: fstat error");
+    }
+    if (statbuff.st_size == 0) {
+        sprintf(hdr, "%*lld%c%*lld\n", SEQ_SZ, 1LL, SPACE, SEQ_SZ, (long long)FEEDHDR_SZ);
+        if (_db_writen(db->logfd, hdr, FEEDHDR_SZ, 0) != FEEDHDR_SZ) {
+            err_dump("db_feed: write error of header");
+        }
+    }
+    if (_db_unlock(db->logfd, 0, SEEK_SET, FEEDHDR_SZ) < 0) {
+        err_dump("db_feed: un_lock error");
+    }
+
+doreturn:
+    while (--i >= 0) {
+        _db_unlockexcl(dbs[i]);
+    }
+    return rc;
+}
+
+static void _db_log(DB *db, int op, const char *key, const char *data, time_t expire, int more)
+{
+    // 将一个修改追加到变更流, 调用者持有该键所在散列链的写锁, 所以同一个键的修改
+    // 在变更流中的顺序与实际执行的顺序相同.
+    // more 非0时是事务中的一个操作, 保持头部的锁, 直到事务最后一个操作
+    // 修改已经写入数据库文件, 在这里终止的进程会使这个修改从变更流中丢失(见 apue_db.h)
+
+    char   buf[LOGREC_MAX], hdr[FEEDHDR_SZ + 1];
+    size_t keylen, datlen, n;
+
+    // 分片的修改记录到分片数据库共用的变更流中
+    db = db->logdb;
+    if (db->logfd < 0) {
+        return;
+    }
+    if (!db->inlog) {
+        if (_db_lockw(db->logfd, F_WRLCK, 0, SEEK_SET, FEEDHDR_SZ) < 0) {
+            err_dump("_db_log: writew_lock error");
+        }
+        if (_db_readn(db->logfd, hdr, FEEDHDR_SZ, 0) != FEEDHDR_SZ || hdr[FEEDHDR_SZ - 1] != NEWLINE) {
+            err_dump("_db_log: read error of header");
+        }
+        hdr[SEQ_SZ] = 0;
+        db->logseq = atoll(hdr);
+        db->logoff = atoll(hdr + SEQ_SZ + 1);
+        db->inlog = 1;
+    }
+
+    keylen = strlen(key);
+    datlen = data == NULL ? 0 : strlen(data);
+    sprintf(buf, "%lld%c%c%c%ld%c%ld%c%lld\n", db->logseq, SEP, more ? tolower(op) : op,
+            SEP, (long)keylen, SEP, (long)datlen, SEP, (long long)expire);
+    n = strlen(buf);
+    memcpy(buf + n, key, keylen);
+    n += keylen;
+    if (data != NULL) {
+        memcpy(buf + n, data, datlen);
+        n += datlen;
+    }
+    buf[n++] = NEWLINE;
+
+    // 写在已提交的长度之后, 覆盖之前崩溃的进程留下的没有提交的记录.
+    // 序列号同样从头部读出, 那些记录的序列号被重新使用
+    if (_db_writen(db->logfd, buf, n, db->logoff) != n) {
+        err_dump("_db_log: write error of change record");
+    }
+    db->logseq++;
+    db->logoff += n;
+
+    // 最后一个操作之后, 用一次写同时更新序列号和已提交的长度, 读者只读到这里
+    if (!more) {
+        // 序列号或长度写不进 SEQ_SZ 个字符时变更流已不能再用
+        if (snprintf(hdr, sizeof(hdr), "%*lld%c%*lld\n", SEQ_SZ, db->logseq, SPACE,
+                     SEQ_SZ, (long long)db->logoff) != FEEDHDR_SZ) {
+            err_quit("_db_log: change feed header overflow: %lld %lld", db->logseq, (long long)db->logoff);
+        }
+        if (_db_writen(db->logfd, hdr, FEEDHDR_SZ, 0) != FEEDHDR_SZ) {
+            err_dump("_db_log: write error of header");
+        }
+        if (_db_unlock(db->logfd, 0, SEEK_SET, FEEDHDR_SZ) < 0) {
+            err_dump("_db_log: un_lock error");
+        }
+        db->inlog = 0;
+    }
+}
+
+int db_feed_apply(DBHANDLE h, const char *pathname, off_t *offp, long long *seqp)
+{
+    // 从变更流 pathname.log (分片数据库为目录中的 feed.log) 的 *offp 处开始,
+    // 把已提交的记录依次应用到数据库 h.
+    // *seqp 是上一次应用的序列号, 用来检查变更流是否连续
+
+    DB          *db = h;
+    char        *buf, *name, *ptr, *data, *end, key[IDXLEN_MAX + 1];
+    int         fd, napply;
+    char        op;
+    long        keylen, datlen;
+    long long   seq, lastseq, expire;
+    off_t       off, committed;
+    ssize_t     n;
+    struct stat statbuff;
+
+    if ((name = malloc(strlen(pathname) + sizeof(FEED_NAME) + 5)) == NULL ||
+        (buf = malloc(LOGREC_MAX + 1)) == NULL) {
+        err_dump("db_feed_apply: malloc error");
+    }
+    if (stat(pathname, &statbuff) == 0 && S_ISDIR(statbuff.st_mode)) {
+        sprintf(name, "%s/%s.log", pathname, FEED_NAME);
+    } else {
+        sprintf(name, "%s.log", pathname);
+    }
+    fd = open(name, O_RDONLY);
+    free(name);
+    if (fd < 0) {
+        free(buf);
+        return -1;
+    }
+
+    // 只读到头部中已提交的长度, 写者在事务结束时才更新它, 读到的总是完整的事务.
+    // 读头部时加读锁, 不会读到写了一半的头部
+    if (_db_lockw(fd, F_RDLCK, 0, SEEK_SET, FEEDHDR_SZ) < 0) {
+        err_dump("db_feed_apply: readw_lock error");
+    }
+    n = _db_readn(fd, buf, FEEDHDR_SZ, 0);
+    if (_db_unlock(fd, 0, SEEK_SET, FEEDHDR_SZ) < 0) {
+        err_dump("db_feed_apply: un_lock error");
+    }
+    if (n != FEEDHDR_SZ || buf[FEEDHDR_SZ - 1] != NEWLINE) {
+        close(fd);
+        free(buf);
+        errno = EINVAL;
+        return -1;
+    }
+    buf[FEEDHDR_SZ - 1] = 0;
+    committed = atoll(buf + SEQ_SZ + 1);
+    if (*offp < FEEDHDR_SZ) {
+        *offp = FEEDHDR_SZ;     // skip header
+    }
+
+    // off 和 lastseq 是已读到的位置, 只在一个事务结束后才更新 *offp 和 *seqp,
+    // 这样读到半个事务时, 下一次调用会从事务开头重新应用
+    napply = 0;
+    off = *offp;
+    lastseq = *seqp;
+    while (off < committed &&
+           (n = _db_readn(fd, buf, committed - off < LOGREC_MAX ? committed - off : LOGREC_MAX, off)) > 0) {
+        buf[n] = 0;
+        end = buf + n;
+
+        // 解析记录头: 序列号, 操作, 键长度, 数据长度, 过期时间
+        if ((ptr = memchr(buf, NEWLINE, n)) == NULL) {
+            break;      // incomplete record
+        }
+        *ptr++ = 0;
+        if (sscanf(buf, "%lld:%c:%ld:%ld:%lld", &seq, &op, &keylen, &datlen, &expire) != 5 ||
+            keylen <= 0 || keylen > IDXLEN_MAX || datlen < 0 || datlen >= DATLEN_MAX ||
+            (toupper(op) != LOG_STORE && toupper(op) != LOG_DELETE)) {
+            errno = EINVAL;
+            napply = -1;
+            break;
+        }
+        if (ptr + keylen + datlen + 1 > end) {
+            break;      // incomplete record
+        }
+        if (seq != lastseq + 1) {
+            errno = EILSEQ;     // records missing from the feed
+            napply = -1;
+            break;
+        }
+        if (ptr[keylen + datlen] != NEWLINE) {
+            errno = EINVAL;
+            napply = -1;
+            break;
+        }
+        memcpy(key, ptr, keylen);
+        key[keylen] = 0;
+        data = ptr + keylen;
+        data[datlen] = 0;
+
+        // 小写的操作属于一个事务, 在事务的最后一个操作(大写)处一起提交.
+        // 一个事务中每个键只出现一次, 所以可以先查看已提交的数据,
+        // 跳过删除副本中已不存在的记录, 以免整个事务失败
+        if (islower(op) && !db->intxn) {
+            db_txn_begin(db);
+        }
+        if (toupper(op) == LOG_STORE) {
+            _db_store(db, key, data, DB_STORE, expire);
+        } else if (db_fetch(db, key) != NULL) {
+            db_delete(db, key);
+        }
+        off += (ptr - buf) + keylen + datlen + 1;
+        lastseq = seq;
+        napply++;
+        if (isupper(op)) {
+            if (db->intxn) {
+                db_txn_commit(db);
+            }
+            *offp = off;
+            *seqp = seq;
+        }
+    }
+    if (db->intxn) {
+        db_txn_abort(db);       // rest of the transaction not written yet
+    }
+    close(fd);
+    free(buf);
+    return napply;
+}
+
+int db_snapshot(DBHANDLE h, const char *pathname)
+{
+    // 建立数据库在某一时刻的一致副本 pathname.idx 和 pathname.dat
+    // (分片数据库则建立目录 pathname, 其中是各分片的副本)
+
+    // 每个数据库(分片)复制的文件, 以及副本中必须删除的旧文件
+    static const char *suffix[NSNAP] = { ".idx", ".dat", ".exp", ".blm" };
+    static const char *stale[2] = { ".log", ".shm" };
+
+    DB          *db = h, **dbs, *sdb;
+    int         i, j, n, rc, newdir, *fds, *srcfds;
+    size_t      len;
+    char        *name;
+    struct stat statbuff;
+
+    if (db->nshard > 0) {
+        dbs = db->shard;
+        n = db->nshard;
+    } else {
+        dbs = &db;
+        n = 1;
+    }
+    if (fstat(dbs[0]->idxfd, &statbuff) < 0) {
+        err_sys("db_snapshot: fstat error");
+    }
+    len = strlen(pathname);
+    if ((name = malloc(len + sizeof(NSHARD_NAME) + sizeof(FEED_NAME) + 10)) == NULL ||
+        (fds = malloc(NSNAP * n * sizeof(int))) == NULL || (srcfds = malloc(NSNAP * n * sizeof(int))) == NULL) {
+        err_dump("db_snapshot: malloc error");
+    }
+    for (i = 0; i < NSNAP * n; i++) {
+        fds[i] = -1;
+    }
+
+    // 分片副本的目录记录与原数据库相同的分片数, 替换目录中原有的记录.
+    // 副本没有变更流, 删除目录中旧的变更流
+    rc = newdir = 0;
+    if (db->nshard > 0) {
+        if (!(newdir = mkdir(pathname, (statbuff.st_mode & 0777) | S_IRWXU) == 0) && errno != EEXIST) {
+            rc = -1;
+        }
+        sprintf(name, "%s/%s", pathname, NSHARD_NAME);
+        if (rc == 0 && ((unlink(name) < 0 && errno != ENOENT) || _db_nshard(pathname, n, statbuff.st_mode) != n)) {
+            rc = -1;
+        }
+        sprintf(name, "%s/%s.log", pathname, FEED_NAME);
+        if (rc == 0 && unlink(name) < 0 && errno != ENOENT) {
+            rc = -1;
+        }
+    }
+
+    // 在加锁之前先建立所有的目标文件, 尽量缩短阻塞写操作的时间.
+    // 复制索引文件, 数据文件, 以及过期索引和布隆过滤器(如果有). 过期索引可能是在
+    // 这个句柄打开之后才由其他句柄建立的, 先试着打开它. 布隆过滤器从映射中复制.
+    // 原数据库没有的文件, 以及变更流和共享内存目录, 从副本中删除旧的
+    for (i = 0; i < NSNAP * n && rc == 0; i++) {
+        j = i % NSNAP;
+        sdb = dbs[i / NSNAP];
+        if (j == 2) {
+            _db_expopen(sdb, 0);
+        }
+        srcfds[i] = j == 0 ? sdb->idxfd : j == 1 ? sdb->datfd : j == 2 ? sdb->expfd : -1;
+        if (db->nshard > 0) {
+            len = sprintf(name, "%s/%d", pathname, i / NSNAP);
+        } else {
+            len = sprintf(name, "%s", pathname);
+        }
+        strcpy(name + len, suffix[j]);
+        if (srcfds[i] < 0 && (j != 3 || sdb->bloom == NULL)) {
+            if (unlink(name) < 0 && errno != ENOENT) {
+                rc = -1;
+            }
+        } else if ((fds[i] = open(name, O_WRONLY | O_CREAT | O_TRUNC, statbuff.st_mode & 0777)) < 0) {
+            rc = -1;
+        }
+        for (int k = 0; j == NSNAP - 1 && k < 2 && rc == 0; k++) {
+            strcpy(name + len, stale[k]);
+            if (unlink(name) < 0 && errno != ENOENT) {
+                rc = -1;
+            }
+        }
+    }
+
+    if (rc == 0) {
+        /*
+         * Barrier: every writer holds a write lock on its hash chain
+         * (and the free list / append locks) in the index file while
+         * it modifies either file or the Bloom filter, and the expiry
+         * index lock while it adds an entry, so a read lock on the
+         * whole of these files of every shard waits for the writers
+         * in progress and holds off new ones. db_fetch and db_nextrec
+         * only take read locks and keep running. With reflinks the
+         * copy itself is a metadata operation and the barrier is short.
+         *
+         * Other handles of this process are held off as well only
+         * where the locks belong to the open file description
+         * (F_OFD_SETLK); with plain fcntl locks the caller must not
+         * write through its other handles meanwhile.
+         *
+         * With a shared directory the chain locks are mutexes, taken
+         * first as always; they hold off db_fetch as well.
+         */
+        for (i = 0; i < n; i++) {
+            _db_lockall(dbs[i]);
+        }
+        for (i = 0; i < NSNAP * n; i++) {
+            if (srcfds[i] >= 0 && _db_lockw(srcfds[i], F_RDLCK, 0, SEEK_SET, i % NSNAP == 0 ? OPEN_OFF : 0) < 0) {
+                err_dump("db_snapshot: readw_lock error");
+            }
+        }
+        for (i = 0; i < NSNAP * n && rc == 0; i++) {
+            sdb = dbs[i / NSNAP];
+            if (srcfds[i] >= 0) {
+                rc = _db_clone(srcfds[i], fds[i]);
+            } else if (fds[i] >= 0) {
+                len = BLMHDR_SZ + sdb->nhash * sdb->blmsz;
+                rc = _db_writen(fds[i], sdb->bloom, len, 0) == len ? 0 : -1;
+            }
+        }
+        for (i = NSNAP * n - 1; i >= 0; i--) {
+            if (srcfds[i] >= 0 && _db_unlock(srcfds[i], 0, SEEK_SET, i % NSNAP == 0 ? OPEN_OFF : 0) < 0) {
+                err_dump("db_snapshot: un_lock error");
+            }
+        }
+        for (i = n - 1; i >= 0; i--) {
+            _db_unlockall(dbs[i]);
+        }
+    }
+
+    for (i = 0; i < NSNAP * n; i++) {
+        if (fds[i] >= 0) {
+            if (rc == 0 && fsync(fds[i]) < 0) {
+                rc = -1;
+            }
+            close(fds[i]);
+        }
+    }
+
+    // 失败时删除建立的文件, 不留下不完整的副本
+    if (rc < 0) {
+        for (i = 0; i < NSNAP * n; i++) {
+            if (fds[i] < 0) {
+                continue;
+            }
+            if (db->nshard > 0) {
+                sprintf(name, "%s/%d%s", pathname, i / NSNAP, suffix[i % NSNAP]);
+            } else {
+                sprintf(name, "%s%s", pathname, suffix[i % NSNAP]);
+            }
+            unlink(name);
+        }
+        if (newdir) {
+            sprintf(name, "%s/%s", pathname, NSHARD_NAME);
+            unlink(name);
+            rmdir(pathname);
+        }
+    }
+    free(srcfds);
+    free(fds);
+    free(name);
+    return rc;
+}
+
+static int _db_clone(int fromfd, int tofd)
+{
+    char    buf[8192];
+    off_t   off;
+    ssize_t n;
+
+#ifdef FICLONE
+    // 文件系统支持 reflink(btrfs, xfs 等)时, 副本与原文件共享数据块, 不需要复制数据
+    if (ioctl(tofd, FICLONE, fromfd) == 0) {
+        return 0;
+    }
+#endif
+
+    // 否则逐块复制. 使用 pread, 不改变 fromfd 的当前偏移量(db_nextrec 依赖它)
+    for (off = 0; (n = _db_readn(fromfd, buf, sizeof(buf), off)) > 0; off += n) {
+        if (_db_writen(tofd, buf, n, -1) != n) {
+            return -1;
+        }
+    }
+    return n < 0 ? -1 : 0;
+}
+
+int db_check(DBHANDLE h)
+{
+    DB            *db = h;
+    unsigned char *seen;
+    char          asciiptr[PTR_SZ + 1];
+    off_t         offset, next, first;
+    int           n, nbad = 0;
+    struct stat   idxstat, datstat;
+
+    if (db->nshard > 0) {
+        for (int i = 0; i < db->nshard; i++) {
+            if ((n = db_check(db->shard[i])) < 0) {
+                return -1;
+            }
+            nbad += n;
+        }
+        return nbad;
+    }
+
+    // 与 db_snapshot 相同的屏障: 等待正在进行的修改完成, 检查期间没有新的修改
+    _db_lockall(db);
+    if (_db_lockw(db->idxfd, F_RDLCK, 0, SEEK_SET, OPEN_OFF) < 0) {
+        err_dump("db_check: readw_lock error");
+    }
+    if (fstat(db->idxfd, &idxstat) < 0 || fstat(db->datfd, &datstat) < 0) {
+        err_sys("db_check: fstat error");
+    }
+
+    // 每条索引记录只能在一条链上出现一次, 用位图记下访问过的记录, 同时发现环
+    first = db->recoff;
+    if ((seen = calloc(idxstat.st_size / 8 + 1, 1)) == NULL) {
+        err_dump("db_check: calloc error");
+    }
+
+    // i 为 nhash 时检查空闲链表
+    for (DBHASH i = 0; i <= db->nhash; i++) {
+        if (i == db->nhash) {
+            offset = _db_readptr(db, FREE_OFF);
+        } else {
+            offset = _db_readptr(db, db->hashoff + i * PTR_SZ);
+            if (db->shm != NULL) {
+                // 共享内存目录中的链首必须与索引文件一致
+                if (_db_readn(db->idxfd, asciiptr, PTR_SZ, db->hashoff + i * PTR_SZ) != PTR_SZ) {
+                    err_dump("db_check: read error of ptr field");
+                }
+                asciiptr[PTR_SZ] = 0;
+                if (atol(asciiptr) != offset) {
+                    nbad++;
+                }
+            }
+        }
+        while (offset != 0) {
+            if (offset < first || offset >= idxstat.st_size || (seen[offset / 8] & (1 << (offset % 8))) ||
+                _db_checkrec(db, offset, i, datstat.st_size, &next) < 0) {
+                nbad++;
+                break;      // the rest of the chain can't be followed
+            }
+            seen[offset / 8] |= 1 << (offset % 8);
+            offset = next;
+        }
+    }
+    free(seen);
+
+    if (_db_unlock(db->idxfd, 0, SEEK_SET, OPEN_OFF) < 0) {
+        err_dump("db_check: un_lock error");
+    }
+    _db_unlockall(db);
+    return nbad;
+}
+
+static int _db_checkrec(DB *db, off_t offset, DBHASH chain, off_t datsize, off_t *nextp)
+{
+    // 与 _db_readidx 一样解析一条索引记录, 但遇到错误只返回 -1, 并检查它指向的数据记录.
+    // 使用 pread, 不改变 idxfd 的当前偏移量
+
+    char   buf[PTR_SZ + IDXLEN_SZ + IDXLEN_MAX + 1], c, *ptr1, *ptr2;
+    size_t idxlen;
+    off_t  datoff;
+    long   datlen;
+
+    if (_db_readn(db->idxfd, buf, PTR_SZ + IDXLEN_SZ, offset) != PTR_SZ + IDXLEN_SZ) {
+        return -1;
+    }
+    buf[PTR_SZ + IDXLEN_SZ] = 0;
+    idxlen = atoi(buf + PTR_SZ);
+    buf[PTR_SZ] = 0;
+    *nextp = atol(buf);
+    if (idxlen < IDXLEN_MIX || idxlen > IDXLEN_MAX ||
+        _db_readn(db->idxfd, buf, idxlen, offset + PTR_SZ + IDXLEN_SZ) != idxlen ||
+        buf[idxlen - 1] != NEWLINE) {
+        return -1;
+    }
+    buf[idxlen - 1] = 0;
+
+    // 键, 数据记录的偏移量和长度; 空闲链表上的记录键为空格, 不检查散列值
+    if ((ptr1 = strchr(buf, SEP)) == NULL || (ptr2 = strchr(ptr1 + 1, SEP)) == NULL ||
+        strchr(ptr2 + 1, SEP) != NULL) {
+        return -1;
+    }
+    *ptr1++ = 0;
+    *ptr2++ = 0;
+    datoff = atol(ptr1);
+    datlen = atol(ptr2);
+    if (datoff < 0 || datlen <= 0 || datlen > DATLEN_MAX || datoff + datlen > datsize) {
+        return -1;
+    }
+    if (chain < db->nhash && _db_hash(db, buf) != chain) {
+        return -1;
+    }
+    if (_db_readn(db->datfd, &c, 1, datoff + datlen - 1) != 1 || c != NEWLINE) {
+        return -1;
+    }
+    return 0;
+}
+
+void db_close(DBHANDLE h)
+{
+    _db_release((DB *)h);   // cache the handle, or close fds & free it
+}
+
+void db_cache(int n)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    DB *evict = NULL, *db;
+
+    pthread_once(&once, _db_atfork);
+
+    pthread_mutex_lock(&poollock);
+    maxcache = n < 0 ? 0 : n;
+    evict = _db_cachetrim();
+    pthread_mutex_unlock(&poollock);
+
+    while ((db = evict) != NULL) {
+        evict = db->next;
+        _db_free(db);
+    }
+}
+
+static DB *_db_cachetrim(void)
+{
+    DB  *db, *evict;
+    int i;
+
+    // 调用者持有 poollock. 把最久没有使用的, 超出 maxcache 的句柄从缓存中分离出来
+    if (ncache <= maxcache) {
+        return NULL;
+    }
+    if (maxcache == 0) {
+        evict = dbcache;
+        dbcache = NULL;
+    } else {
+        for (db = dbcache, i = 1; i < maxcache; i++) {
+            db = db->next;
+        }
+        evict = db->next;
+        db->next = NULL;
+    }
+    ncache = maxcache;
+    return evict;
+}
+
+static DB *_db_cachefind(const char *pathname, int oflag)
+{
+    DB          *db, **pp, *drop = NULL, *p;
+    size_t      len = strlen(pathname);
+
+    // name 中是打开时最后构造的 pathname 加上 4 个字符的后缀.
+    // 重新建立数据库时丢弃该数据库的所有句柄, 否则取最近关闭的一个同样读写方式的句柄
+    pthread_mutex_lock(&poollock);
+    for (pp = &dbcache; (db = *pp) != NULL; ) {
+        if (strncmp(db->name, pathname, len) != 0 || strlen(db->name) != len + 4) {
+            pp = &db->next;
+        } else if (oflag & O_TRUNC) {
+            *pp = db->next;
+            ncache--;
+            db->next = drop;
+            drop = db;
+        } else if (db->accmode == (oflag & O_ACCMODE)) {
+            *pp = db->next;
+            ncache--;
+            break;
+        } else {
+            pp = &db->next;
+        }
+    }
+    pthread_mutex_unlock(&poollock);
+
+    while ((p = drop) != NULL) {
+        drop = p->next;
+        _db_free(p);
+    }
+    if (db == NULL) {
+        return NULL;
+    }
+
+    // 文件被替换或重新建立过的句柄作废
+    if (_db_cachestale(db, len)) {
+        _db_free(db);
+        return NULL;
+    }
+
+    // 统计计数器在 DB 结构的末尾, 取回的句柄与新打开的一样从 0 开始计数
+    memset(&db->cnt_delok, 0, sizeof(DB) - offsetof(DB, cnt_delok));
+    return db;
+}
+
+static int _db_cachestale(DB *db, size_t len)
+{
+    static const char *suffix[] = { ".idx", ".dat", ".log", ".exp", ".blm", ".shm" };
+    ino_t       ino[] = { db->idxino, db->datino, db->logino, db->expino, db->blmino, db->shmino };
+    struct stat statbuff;
+
+    // 句柄使用的文件必须还是原来的 i-node, 不使用的文件必须仍然不存在.
+    // 只读句柄不打开变更流和过期索引, 不检查它们
+    for (size_t i = 0; i < sizeof(suffix) / sizeof(suffix[0]); i++) {
+        if (db->accmode == O_RDONLY && (i == 2 || i == 3)) {
+            continue;
+        }
+        strcpy(db->name + len, suffix[i]);
+        if (stat(db->name, &statbuff) < 0) {
+            if (errno != ENOENT || ino[i] != 0) {
+                return 1;
+            }
+        } else if (ino[i] == 0 || statbuff.st_dev != db->dev || statbuff.st_ino != ino[i]) {
+            return 1;
+        }
+    }
+
+    // O_TRUNC 重新建立的索引文件 i-node 不变, 只有世代不同
+    return _db_readgen(db) != db->gen;
+}
+
+static long long _db_readgen(DB *db)
+{
+    char      buf[GEN_SZ + 1], *ptr;
+    long long gen;
+
+    // 字段不完整或不是数字(旧格式的索引文件在这里是索引记录)时返回 0
+    if (_db_readn(db->idxfd, buf, GEN_SZ + 1, GEN_OFF) != GEN_SZ + 1 || buf[GEN_SZ] != NEWLINE) {
+        return 0;
+    }
+    buf[GEN_SZ] = 0;
+    gen = strtoll(buf, &ptr, 10);
+    return ptr == buf + GEN_SZ && gen > 0 ? gen : 0;
+}
+
+static void _db_release(DB *db)
+{
+    DB          *evict;
+    int         cache;
+    struct stat statbuff;
+
+    if (db->shard != NULL) {
+        for (int i = 0; i < db->nshard; i++) {
+            if (db->shard[i] != NULL) {
+                _db_release(db->shard[i]);
+                db->shard[i] = NULL;
+            }
+        }
+    }
+    pthread_mutex_lock(&poollock);
+    cache = maxcache > 0;
+    pthread_mutex_unlock(&poollock);
+    if (!cache || db->idxfd < 0) {
+        _db_free(db);
+        return;
+    }
+
+    // 记下文件的 i-node, 取回时用来判断文件是否已被替换
+    if (db->intxn || db->ntxnop > 0) {
+        db_txn_abort(db);
+    }
+    if (fstat(db->idxfd, &statbuff) < 0) {
+        err_sys("db_close: fstat error");
+    }
+    db->dev = statbuff.st_dev;
+    db->idxino = statbuff.st_ino;
+    if (fstat(db->datfd, &statbuff) < 0) {
+        err_sys("db_close: fstat error");
+    }
+    db->datino = statbuff.st_ino;
+    db->logino = db->expino = db->shmino = 0;
+    if (db->logfd >= 0) {
+        if (fstat(db->logfd, &statbuff) < 0) {
+            err_sys("db_close: fstat error");
+        }
+        db->logino = statbuff.st_ino;
+    }
+    if (db->expfd >= 0) {
+        if (fstat(db->expfd, &statbuff) < 0) {
+            err_sys("db_close: fstat error");
+        }
+        db->expino = statbuff.st_ino;
+    }
+    if (db->shmfd >= 0) {
+        if (fstat(db->shmfd, &statbuff) < 0) {
+            err_sys("db_close: fstat error");
+        }
+        db->shmino = statbuff.st_ino;
+    }
+
+    // 放在缓存的最前面, 缓存已满时释放最久没有使用的句柄
+    pthread_mutex_lock(&poollock);
+    db->next = dbcache;
+    dbcache = db;
+    ncache++;
+    evict = _db_cachetrim();
+    pthread_mutex_unlock(&poollock);
+
+    while ((db = evict) != NULL) {
+        evict = db->next;
+        _db_free(db);
+    }
+}
+
+static void _db_atfork(void)
+{
+    if (pthread_atfork(_db_prefork, _db_postfork, _db_childfork) != 0) {
+        err_dump("db_cache: pthread_atfork error");
+    }
+}
+
+static void _db_prefork(void)
+{
+    pthread_mutex_lock(&poollock);
+}
+
+static void _db_postfork(void)
+{
+    pthread_mutex_unlock(&poollock);
+}
+
+static void _db_childfork(void)
+{
+    DB *db, *evict;
+
+    // 子进程与父进程共享缓存中句柄的文件偏移量, 不能使用它们, 关闭子进程中的副本
+    evict = dbcache;
+    dbcache = NULL;
+    ncache = 0;
+    pthread_mutex_unlock(&poollock);
+
+    while ((db = evict) != NULL) {
+        evict = db->next;
+        _db_free(db);
+    }
+}
+
+static void _db_free(DB *db)
+{
+    if (db->shard != NULL) {
+        for (int i = 0; i < db->nshard; i++) {
+            if (db->shard[i] != NULL) { _db_free(db->shard[i]); }
+        }
+        free(db->shard);
+    }
+    if (db->txnop != NULL) {
+        _db_txn_free(db);
+        free(db->txnop);
+    }
+    if (db->idxfd >= 0)     { close(db->idxfd); }
+    if (db->datfd >= 0)     { close(db->datfd); }
+    if (db->logfd >= 0)     { close(db->logfd); }
+    if (db->expfd >= 0)     { close(db->expfd); }
+    if (db->bloom != NULL)  { munmap(db->bloom, BLMHDR_SZ + db->nhash * db->blmsz); }
+    if (db->shm != NULL)    { munmap(db->shm, sizeof(DBSHM) + db->nhash * sizeof(DBCHAIN)); }
+    if (db->shmfd >= 0)     { close(db->shmfd); }
+    if (db->cmpbuf != NULL) { free(db->cmpbuf); }
+    if (db->dicthash != NULL) { free(db->dicthash); }
+    if (db->linked != NULL) { free(db->linked); }
+
+    // 缓冲区齐全的DB结构放回池中, 留给下一次 db_open
+    pthread_mutex_lock(&poollock);
+    if (npool < DBPOOL_MAX && db->name != NULL && db->idxbuf != NULL &&
+        db->datbuf != NULL && db->encbuf != NULL) {
+        db->next = dbpool;
+        dbpool = db;
+        npool++;
+        db = NULL;
+    }
+    pthread_mutex_unlock(&poollock);
+    if (db == NULL) {
+        return;
+    }
+
+    if (db->idxbuf != NULL) { free(db->idxbuf); }
+    if (db->datbuf != NULL) { free(db->datbuf); }
+    if (db->name != NULL)   { free(db->name);   }
+    if (db->encbuf != NULL) { free(db->encbuf); }
+    free(db);
+}
+
+static void _db_linkmap(DB *db)
+{
+    off_t         pos, offset, n;
+    unsigned char *map;
+
+    // 与 db_check 一样每条索引记录用一位. 扫描期间追加的记录可能超出开始时的
+    // 文件长度, 需要时扩大位图. 走链时移动了 idxfd 的偏移量, 最后恢复
+    if ((pos = lseek(db->idxfd, 0, SEEK_CUR)) == -1) {
+        err_dump("db_nextrec: lseek error");
+    }
+    db->nlinked = lseek(db->idxfd, 0, SEEK_END) + 1;
+    if (db->nlinked <= 0 || (db->linked = calloc(db->nlinked / 8 + 1, 1)) == NULL) {
+        err_dump("db_nextrec: calloc error");
+    }
+    for (DBHASH i = 0; i < db->nhash; i++) {
+        _db_lockchain(db, db->hashoff + i * PTR_SZ, 0);
+        offset = _db_readptr(db, db->hashoff + i * PTR_SZ);
+        while (offset >= db->recoff) {
+            if (offset >= db->nlinked) {
+                n = 2 * offset;
+                if ((map = realloc(db->linked, n / 8 + 1)) == NULL) {
+                    err_dump("db_nextrec: realloc error");
+                }
+                memset(map + db->nlinked / 8 + 1, 0, n / 8 - db->nlinked / 8);
+                db->linked = map;
+                db->nlinked = n;
+            }
+            if (db->linked[offset / 8] & (1 << (offset % 8))) {
+                break;      // a loop, db_check reports it
+            }
+            db->linked[offset / 8] |= 1 << (offset % 8);
+            offset = _db_readptr(db, offset);   // chain ptr leads the record
+        }
+        _db_unlockchain(db, db->hashoff + i * PTR_SZ);
+    }
+    if (lseek(db->idxfd, pos, SEEK_SET) == -1) {
+        err_dump("db_nextrec: lseek error");
+    }
+}
+
+static DBHASH _db_hash(DB *db, const char *key)
+{
+    DBHASH hval = 0;
+    char c;
+
+    for (int i = 0; (c = *key++) != 0; i++) {
+        hval += c * i;      // ascii char times its 1-based index
+    }
+    return (hval % db->nhash);
+}
+
+static char *_db_readdat(DB *db)
+{
+    char   *ptr;
+    size_t len;
+
+    // 在datoff和datlen已经被正确初始化后, _db_readdat函数将数据记录的内容读入DB结构
+    if (lseek(db->datfd, db->datoff, SEEK_SET) == -1) {
+        err_dump("_db_readdat: lseek error");
+    }
+    if (_db_readn(db->datfd, db->datbuf, db->datlen, -1) != db->datlen) {
+        err_dump("_db_readdat: read error");
+    }
+    if (db->datbuf[db->datlen - 1] != NEWLINE) {
+        err_dump("_db_readdat: missing newline");
+    }
+    db->datbuf[db->datlen - 1] = 0;     // replace newline with null
+
+    // 取出过期时间, 并解压缩
+    ptr = db->datbuf;
+    len = db->datlen - 1;
+    db->expire = 0;
+    if (len >= EXP_HDR_SZ && ptr[0] == EXP_MARK) {
+        db->expire = _db_getexpire(ptr);
+        ptr += EXP_HDR_SZ;
+        len -= EXP_HDR_SZ;
+    }
+    if (db->cmpbuf != NULL) {
+        return _db_decode(db, ptr, len);
+    }
+    return ptr;
+}
+
+static off_t _db_readidx(DB *db, off_t offset)
+{
+    ssize_t      i;
+    char         *ptr1, *ptr2;
+    char         asciiptr[PTR_SZ + 1], asciilen[IDXLEN_SZ + 1];
+    struct iovec iov[2];
+
+    // 按调用者提供的参数查找索引文件偏移量, 并记录在DB结构中
+    if ((db->idxoff = lseek(db->idxfd, offset, offset == 0 ? SEEK_CUR : SEEK_SET)) == -1) {
+        err_dump("_db_readix: lseek error");
+    }
+
+    // 调用readv读在索引记录开始处的两个定长字段: 指向下一索引记录的链指针和该索引记录余下部分的长度
+    iov[0].iov_base = asciiptr;
+    iov[0].iov_len  = PTR_SZ;
+    iov[1].iov_base = asciilen;
+    iov[1].iov_len  = IDXLEN_SZ;
+    if ((i = _db_readv(db->idxfd, &iov[0], 2)) != PTR_SZ + IDXLEN_SZ) {
+        if (i == 0 && offset == 0) {
+            return -1;      // EOF for db_nextree
+        }
+        err_dump("_db_readidx: readv error of index record");
+    }
+
+    // 将下一记录的偏移量转换为整形, 并存放到ptrval字段中, 这将被用作此函数返回值
+    asciiptr[PTR_SZ] = 0;           // null terminate
+    db->ptrval = atol(asciiptr);    // offset of next key in chain
+
+    // 将索引记录的长度转换为整型，并存放到idxlen字段中
+    asciilen[IDXLEN_SZ] = 0;        // null terminate
+    if ((db->idxlen = atoi(asciilen)) < IDXLEN_MIX || db->idxlen > IDXLEN_MAX) {
+        err_dump("_db_readidx: invalid length");
+    }
+
+    // 将索引记录的变长部分读入DB结构中的idxbuf字段. 该记录以null字符代替换行符结尾
+    if ((i = _db_readn(db->idxfd, db->idxbuf, db->idxlen, -1)) != db->idxlen) {
+        err_dump("_db_readidx: read error of index record");
+    }
+    if (db->idxbuf[db->idxlen - 1] != NEWLINE) {
+        err_dump("_db_readidx: missing newline");
+    }
+    db->idxbuf[db->idxlen - 1] = 0;
+
+    // 将索引记录划分成3个字段: 键, 对应数据记录的偏移量和数据记录的长度
+    // strchr函数在给定字符串中找到第一个指定字符
+    if ((ptr1 = strchr(db->idxbuf, SEP)) == NULL) {
+        err_dump("_db_readix: missing first separator");
     }
     *ptr1++ = 0;        // replace SEP with null
     if ((ptr2 = strchr(ptr1, SEP)) == NULL) {
@@ -480,17 +3233,22 @@ static off_t _db_readptr(DB *db, off_t offset)
 {
     char asciiptr[PTR_SZ + 1];
 
+    // 散列表中的指针直接从共享内存目录中取得
+    if (db->shm != NULL && offset >= db->hashoff && offset < db->hashoff + db->nhash * PTR_SZ) {
+        return db->shm->chain[(offset - db->hashoff) / PTR_SZ].head;
+    }
+
     if (lseek(db->idxfd, offset, SEEK_SET) == -1) {
         err_dump("_db_readptr: lseek error to ptr field");
     }
-    if (read(db->idxfd, asciiptr, PTR_SZ) != PTR_SZ) {
+    if (_db_readn(db->idxfd, asciiptr, PTR_SZ, -1) != PTR_SZ) {
         err_dump("_db_readptr: read error of ptr field");
     }
     asciiptr[PTR_SZ] = 0;       // null terminate
     return (atol(asciiptr));
 }
 
-static void _db_writedat(DB *db, const char *data, off_t offset, int whence)
+static void _db_writedat(DB *db, const char *data, size_t len, off_t offset, int whence)
 {
     // 当删除一条记录时, 调用函数_db_writedat清空数据记录
     // 当被db_store调用时, 追加写数据文件
@@ -498,9 +3256,9 @@ static void _db_writedat(DB *db, const char *data, off_t offset, int whence)
     struct iovec iov[2];
     static char  newline = NEWLINE;
 
-    if (whence == SEEK_SET) {
+    if (whence == SEEK_END) {
         // 追加写, 需要对文件加锁
-        if (writew_lock(db->datfd, 0, SEEK_SET, 0) < 0) {
+        if (_db_lockw(db->datfd, F_WRLCK, 0, SEEK_SET, 0) < 0) {
             err_dump("_db_writedat: writew_lock error");
         }
     }
@@ -509,7 +3267,7 @@ static void _db_writedat(DB *db, const char *data, off_t offset, int whence)
     if((db->datoff = lseek(db->datfd, offset, whence)) == -1) {
         err_dump("_db_writedat: lseek error");
     }
-    db->datlen = strlen(data) + 1;      /// includes newline
+    db->datlen = len + 1;       // includes newline
 
     // 设置iovec数组, 调用writev写数据记录和换行符
     // 不能想当然地认为调用者缓冲区的尾端有空间可以追加换行符,
@@ -518,13 +3276,13 @@ static void _db_writedat(DB *db, const char *data, off_t offset, int whence)
     iov[0].iov_len  = db->datlen - 1;
     iov[1].iov_base = &newline;
     iov[1].iov_len  = 1;
-    if (writev(db->datfd, &iov[0], 2) != db->datlen) {
+    if (_db_writev(db->datfd, &iov[0], 2) != db->datlen) {
         err_dump("_db_writedat: writev error of data record");
     }
 
     // 如果正在对文件追加一条记录, 那么就释放早先获得的锁
     if (whence == SEEK_END) {
-        if (un_lock(db->datfd, 0, SEEK_SET, 0) < 0) {
+        if (_db_unlock(db->datfd, 0, SEEK_SET, 0) < 0) {
             err_dump("_db_writedat: un_lock error");
         }
     }
@@ -552,7 +3310,7 @@ static void _db_writeidx(DB *db, const char *key, off_t offset, int whence, off_
 
     // 只有在追加新索引记录时这一函数才需要加锁
     if (whence == SEEK_END) {
-        if (writew_lock(db->idxfd, ((db->nhash + 1) * PTR_SZ) + 1, SEEK_SET, 0) < 0) {
+        if (_db_lockw(db->idxfd, F_WRLCK, db->recoff, SEEK_SET, OPEN_OFF - db->recoff) < 0) {
             err_dump("_db_writeidx: writew_lock error");
         }
     }
@@ -567,13 +3325,13 @@ static void _db_writeidx(DB *db, const char *key, off_t offset, int whence, off_
     iov[0].iov_len  = PTR_SZ + IDXLEN_SZ;
     iov[1].iov_base = db->idxbuf;
     iov[1].iov_len  = len;
-    if (writev(db->idxfd, &iov[0], 2) != PTR_SZ + IDXLEN_SZ + len) {
+    if (_db_writev(db->idxfd, &iov[0], 2) != PTR_SZ + IDXLEN_SZ + len) {
         err_dump("_db_writeidx: writev error of index record");
     }
 
     // 如果是追加写该文件, 则释放在定位操作前获得的锁
     if (whence == SEEK_END) {
-        if (un_lock(db->idxfd, ((db->nhash + 1) * PTR_SZ) + 1, SEEK_SET, 0) < 0) {
+        if (_db_unlock(db->idxfd, db->recoff, SEEK_SET, OPEN_OFF - db->recoff) < 0) {
             err_dump("_db_writeidx: un_lock error");
         }
     }
@@ -595,56 +3353,369 @@ static void _db_writeptr(DB *db, off_t offset, off_t ptrval)
     if (lseek(db->idxfd, offset, SEEK_SET) == -1) {
         err_dump("_db_writeptr: lseek error to ptr field");
     }
-    if (write(db->idxfd, asciiptr, PTR_SZ) != PTR_SZ) {
+    if (_db_writen(db->idxfd, asciiptr, PTR_SZ, -1) != PTR_SZ) {
         err_dump("_db_writeptr: write error of ptr field");
     }
+
+    // 先写索引文件再更新共享内存目录, 进程在两者之间终止时可以从索引文件恢复
+    if (db->shm != NULL && offset >= db->hashoff && offset < db->hashoff + db->nhash * PTR_SZ) {
+        db->shm->chain[(offset - db->hashoff) / PTR_SZ].head = ptrval;
+    }
+}
+
+
+static int _db_lockreg(int fd, int cmd, int type, off_t offset, int whence, off_t len)
+{
+    struct flock lock;
+
+    // 与 lock_reg 相同, 但 l_pid 必须为0才能用作打开文件描述的锁
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;         // F_RDLCK, F_WRLCK, F_UNLCK
+    lock.l_start = offset;      // byte offset, relative to l_whence
+    lock.l_whence = whence;     // SEEK_SET, SEEK_CUR, SEEK_END
+    lock.l_len = len;           // #bytes (0 means to EOF)
+    return fcntl(fd, cmd, &lock);
+}
+
+static int _db_lockw(int fd, int type, off_t offset, int whence, off_t len)
+{
+    // 等待记录锁时被信号中断, 则继续等待
+    for (;;) {
+        if (_db_fault() == FAULT_EINTR) {
+            errno = EINTR;
+            continue;
+        }
+        if (_db_lockreg(fd, DB_SETLKW, type, offset, whence, len) == 0) {
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+static int _db_lockexcl(DB *db)
+{
+    int  len = strlen(db->name) - 4;
+    char c;
+
+    // 本进程缓存中同一数据库的句柄也持有 OPEN_OFF 的读锁, 先关闭它们.
+    // name 中是 pathname 加上 4 个字符的后缀
+    c = db->name[len];
+    db->name[len] = 0;
+    _db_cachefind(db->name, O_TRUNC);
+    db->name[len] = c;
+
+    // 只读打开的句柄不能加写锁, 返回 EBADF
+    if (_db_trylock(db->idxfd, F_WRLCK, OPEN_OFF, SEEK_SET, 1) == 0) {
+        return 0;
+    }
+    if (errno == EACCES || errno == EAGAIN) {
+        errno = EBUSY;
+    } else if (errno != EBADF) {
+        err_dump("_db_lockexcl: write_lock error");
+    }
+    return -1;
+}
+
+static void _db_unlockexcl(DB *db)
+{
+    if (_db_lockw(db->idxfd, F_RDLCK, OPEN_OFF, SEEK_SET, 1) < 0) {
+        err_dump("_db_unlockexcl: readw_lock error");
+    }
+}
+
+static ssize_t _db_readn(int fd, void *buf, size_t nbytes, off_t offset)
+{
+    char         *ptr = buf;
+    size_t       nleft = nbytes;
+    ssize_t      n;
+    struct iovec iov;
+
+    if (offset < 0) {
+        iov.iov_base = buf;
+        iov.iov_len  = nbytes;
+        return _db_readv(fd, &iov, 1);
+    }
+
+    // 被信号中断时重试, 只读了一部分时继续读, 直到读够或者到达文件尾
+    while (nleft > 0) {
+        switch (_db_fault()) {
+        case FAULT_EINTR:
+            n = -1;
+            errno = EINTR;
+            break;
+        case FAULT_SHORT:
+            n = pread(fd, ptr, (nleft + 1) / 2, offset);
+            break;
+        default:
+            n = pread(fd, ptr, nleft, offset);
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;      // EOF
+        }
+        ptr += n;
+        nleft -= n;
+        offset += n;
+    }
+    return nbytes - nleft;
+}
+
+static ssize_t _db_writen(int fd, const void *buf, size_t nbytes, off_t offset)
+{
+    const char   *ptr = buf;
+    size_t       nleft = nbytes;
+    ssize_t      n;
+    struct iovec iov;
+
+    if (offset < 0) {
+        iov.iov_base = (void *)buf;
+        iov.iov_len  = nbytes;
+        return _db_writev(fd, &iov, 1);
+    }
+
+    while (nleft > 0) {
+        switch (_db_fault()) {
+        case FAULT_EINTR:
+            n = -1;
+            errno = EINTR;
+            break;
+        case FAULT_SHORT:
+            n = pwrite(fd, ptr, (nleft + 1) / 2, offset);
+            break;
+        default:
+            n = pwrite(fd, ptr, nleft, offset);
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ptr += n;
+        nleft -= n;
+        offset += n;
+    }
+    return nbytes;
+}
+
+static ssize_t _db_readv(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t n, total = 0;
+
+    // 被信号中断时重试; 只读了一部分时跳过已经读满的 iovec, 调整第一个没有读满的,
+    // 直到读够或者到达文件尾. 调用者的 iovec 数组会被修改
+    while (iovcnt > 0) {
+        if (iov->iov_len == 0) {
+            iov++;
+            iovcnt--;
+            continue;
+        }
+        switch (_db_fault()) {
+        case FAULT_EINTR:
+            n = -1;
+            errno = EINTR;
+            break;
+        case FAULT_SHORT:
+            n = read(fd, iov->iov_base, (iov->iov_len + 1) / 2);
+            break;
+        default:
+            n = readv(fd, iov, iovcnt);
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;      // EOF
+        }
+        total += n;
+        for (; iovcnt > 0 && n >= iov->iov_len; iov++, iovcnt--) {
+            n -= iov->iov_len;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return total;
+}
+
+static ssize_t _db_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t n, total = 0;
+
+    while (iovcnt > 0) {
+        if (iov->iov_len == 0) {
+            iov++;
+            iovcnt--;
+            continue;
+        }
+        switch (_db_fault()) {
+        case FAULT_EINTR:
+            n = -1;
+            errno = EINTR;
+            break;
+        case FAULT_SHORT:
+            n = write(fd, iov->iov_base, (iov->iov_len + 1) / 2);
+            break;
+        default:
+            n = writev(fd, iov, iovcnt);
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        total += n;
+        for (; iovcnt > 0 && n >= iov->iov_len; iov++, iovcnt--) {
+            n -= iov->iov_len;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return total;
 }
 
+#ifdef DB_FAULT
+static int _db_fault(void)
+{
+    // 平均每 DB_FAULT 次调用注入一次故障. 多个线程同时做 I/O, 状态是每个线程
+    // 各自的, 种子由进程ID和线程的变量地址组成, 各线程注入的时机不同
+    static __thread int          rate = -1;
+    static __thread unsigned int seed;
+    char                         *ptr;
+
+    if (rate < 0) {
+        rate = (ptr = getenv("DB_FAULT")) != NULL ? atoi(ptr) : 0;
+        seed = getpid() ^ (unsigned int)(uintptr_t)&seed;
+    }
+    if (rate <= 0 || rand_r(&seed) % rate != 0) {
+        return FAULT_NONE;
+    }
+    return rand_r(&seed) % 2 == 0 ? FAULT_EINTR : FAULT_SHORT;
+}
+#endif
+
 void db_rewind(DBHANDLE h)
 {
     DB    *db = h;
     off_t offset;
 
-    offset = (db->nhash + 1) * PTR_SZ;
+    if (db->nshard > 0) {
+        for (db->curshard = 0; db->curshard < db->nshard; db->curshard++) {
+            db_rewind(db->shard[db->curshard]);
+        }
+        db->curshard = 0;
+        return;
+    }
+
+    offset = db->recoff;
 
-    if ((db->idxoff = lseek(db->idxfd, offset + 1, SEEK_SET)) == -1) {
-        err_dump("db_rewind: lseek error");     // +1 for newline at end of hash table
+    if ((db->idxoff = lseek(db->idxfd, offset, SEEK_SET)) == -1) {
+        err_dump("db_rewind: lseek error");
+    }
+
+    // 下一次 db_nextrec 重新标记散列链上的记录
+    if (db->linked != NULL) {
+        free(db->linked);
+        db->linked = NULL;
     }
 }
 
 char *db_nextrec(DBHANDLE h, char *key)
 {
-    DB   *db = h;
-    char c; 
-    char *ptr;
+    DB     *db = h;
+    char   c; 
+    char   *ptr, name[IDXLEN_MAX];
+    off_t  offset, next, chainoff;
+    time_t now;
+
+    if (db->nshard > 0) {
+        // 依次扫描每个分片, 一个分片扫描完后转到下一个分片
+        while ((ptr = db_nextrec(db->shard[db->curshard], key)) == NULL &&
+               db->curshard < db->nshard - 1) {
+            db->curshard++;
+        }
+        return ptr;
+    }
 
-    if (readw_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0) {
-        err_dump("dp_nextrec: readw_lock error");
+    // 进程在修改时被杀死, 会留下不在任何散列链上的记录(追加了还没有链入,
+    // 或已经移出还没有清空). 扫描开始时把每条散列链走一遍, 记下链上的记录,
+    // 之后只返回其中的记录
+    if (db->linked == NULL) {
+        _db_linkmap(db);
     }
 
-    do {
-        // 调用_db_readidx读下一个记录
-        // 偏移量参数值为0, 以此通知函数从当前偏移量继续读索引记录
-        if (_db_readidx(db, 0) < 0) {
-            ptr = NULL;
-            goto doreturn;
+    now = time(NULL);
+    for ( ; ; ) {
+        if (_db_lockw(db->idxfd, F_RDLCK, FREE_OFF, SEEK_SET, 1) < 0) {
+            err_dump("dp_nextrec: readw_lock error");
         }
+        do {
+            // 调用_db_readidx读下一个记录
+            // 偏移量参数值为0, 以此通知函数从当前偏移量继续读索引记录
+            if (_db_readidx(db, 0) < 0) {
+                ptr = NULL;
+                break;
+            }
 
-        // 读条读取记录, 会读到已删除的记录, 所以跳过键全是空格的记录
-        ptr = db->idxbuf;
-        while ((c = *ptr++) != 0 && c == SPACE);
-    } while (c == 0);
+            // 读条读取记录, 会读到已删除的记录, 所以跳过键全是空格的记录
+            ptr = db->idxbuf;
+            while ((c = *ptr++) != 0 && c == SPACE);
+        } while (c == 0);
+        if (_db_unlock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0) {
+            err_dump("db_nextrec: un_lock error");
+        }
+        if (ptr == NULL) {
+            return NULL;
+        }
+        offset = db->idxoff;
+        if (offset >= db->nlinked || (db->linked[offset / 8] & (1 << (offset % 8))) == 0) {
+            continue;
+        }
 
-    if (key != NULL) {
-        strcpy(key, db->idxbuf);    // return key
+        // 在散列链的读锁下重读索引记录, 键没有变(没有被删除或重新使用)才读数据记录,
+        // 不会读到正在被改写的数据. 之后回到原来的位置继续读索引记录
+        if ((next = lseek(db->idxfd, 0, SEEK_CUR)) == -1) {
+            err_dump("db_nextrec: lseek error");
+        }
+        strcpy(name, db->idxbuf);
+        chainoff = (_db_hash(db, name) * PTR_SZ) + db->hashoff;
+        _db_lockchain(db, chainoff, 0);
+        ptr = NULL;
+        _db_readidx(db, offset);
+        if (strcmp(db->idxbuf, name) == 0) {
+            // 读数据记录, 并将返回值设置为指向包含数据记录的内部缓冲区的指针值,
+            // 跳过已过期的记录
+            ptr = _db_readdat(db);
+            if (db->expire != 0 && db->expire <= now) {
+                ptr = NULL;
+            }
+        }
+        _db_unlockchain(db, chainoff);
+        if (lseek(db->idxfd, next, SEEK_SET) == -1) {
+            err_dump("db_nextrec: lseek error");
+        }
+        if (ptr != NULL) {
+            break;
+        }
     }
-    // 读数据记录, 并将返回值设置为指向包含数据记录的内部缓冲区的指针值
-    ptr = _db_readdat(db);
-    db->cnt_nextrec++;
 
-doreturn:
-    if (un_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0) {
-        err_dump("db_nextrec: un_lock error");
+    if (key != NULL) {
+        strcpy(key, name);          // return key
     }
+    db->cnt_nextrec++;
     return ptr;
 }
\ No newline at end of file
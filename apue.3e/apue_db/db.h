@@ -1,13 +1,26 @@
 #ifndef _DB_H_
 #define _DB_H_
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE     // for F_OFD_SETLK
+#endif
+
 #include "apue.h"
 #include "apue_db.h"
 
 #include <fcntl.h>      // for open & db_open flags
 #include <stdarg.h>
 #include <errno.h>
+#include <ctype.h>
+#include <time.h>
 #include <sys/uio.h>    // for struct iovec
+#include <sys/ioctl.h>
+#include <sys/mman.h>   // for the Bloom filter & shared directory maps
+#include <pthread.h>    // for the shared chain locks
+#include <stdint.h>     // for uintptr_t
+#ifdef __linux__
+#include <linux/fs.h>   // for FICLONE
+#endif
 
 /*
  * Internal index file constants.
@@ -19,6 +32,10 @@
 #define SPACE     ' '   // space character
 #define NEWLINE   '\n'  // newline character
 
+#if IDXLEN_MAX > 9999 || DATLEN_MAX > 9999
+#error IDXLEN_MAX and DATLEN_MAX must fit in IDXLEN_SZ and DICT_LEN_SZ digits
+#endif
+
 /*
  * The following definitions are for hash chains and free
  * list chain in the index file.
@@ -29,15 +46,248 @@
 #define FREE_OFF  0         // free list offset in index file
 #define HASH_OFF  PTR_SZ    // hash table offset in index file
 
+/*
+ * The hash table is followed by the generation of the index file:
+ * the time in microseconds db_open (re)created it, and larger than
+ * that of the file it truncated. A cached handle compares it to tell
+ * a rebuilt file, or a new file on a reused i-node, from its own.
+ */
+#define GEN_OFF   (HASH_OFF + NHASH_DEF * PTR_SZ)
+#define GEN_SZ    20        // size of the generation field
+
+/*
+ * Every open handle holds a read lock on byte OPEN_OFF of the index
+ * file until it is closed. It lies beyond any offset a chain pointer
+ * can hold, and the whole-file locks stop short of it. A handle that
+ * can get a write lock on it is the only one open.
+ */
+#define OPEN_OFF  (PTR_MAX + 1)
+
+/*
+ * Record locks are open file description locks where the system has
+ * them: they belong to the descriptor of one handle, so two handles
+ * in the same process (or thread) exclude each other, and closing
+ * one handle does not release the locks of another. Elsewhere they
+ * are the process-owned POSIX locks.
+ */
+#ifdef F_OFD_SETLK
+#define DB_GETLK  F_OFD_GETLK
+#define DB_SETLK  F_OFD_SETLK
+#define DB_SETLKW F_OFD_SETLKW
+#else
+#define DB_GETLK  F_GETLK
+#define DB_SETLK  F_SETLK
+#define DB_SETLKW F_SETLKW
+#endif
+
+/*
+ * Closed DB structs (with their index, data and encode buffers)
+ * kept for reuse by _db_alloc.
+ */
+#define DBPOOL_MAX 16
+
+/*
+ * Sharded databases: one logical database spread over independent
+ * index/data file pairs inside a directory. The number of shards is
+ * fixed when the directory is created and recorded in the file
+ * NSHARD_NAME ("8\n"), which every db_open reads.
+ */
+#define NSHARD_DEF  8           // number of shards of a new directory, < 1000
+#define NSHARD_NAME "nshard"
+
+/*
+ * Files db_snapshot copies for every database or shard: index, data,
+ * expiry index and Bloom filter.
+ */
+#define NSNAP       4
+
+/*
+ * Value compression. A compressed database starts its data file
+ * with DICT_MAGIC, the raw-size threshold, the dictionary length,
+ * a newline, the dictionary and another newline. Every data record
+ * of a compressed database begins with CMP_RAW or CMP_LZ.
+ */
+#define DICT_MAGIC    "\001DICT"
+#define DICT_MAGIC_SZ 5
+#define DICT_LEN_SZ   4             // threshold & dictionary length (ASCII chars)
+#define DICT_MAX      4096          // max dictionary size
+#define CMP_RAW       'r'           // value stored as is
+#define CMP_LZ        'z'           // value compressed
+#define LZ_MINMATCH   4             // shortest match worth encoding
+#define LZ_MAXMATCH   (LZ_MINMATCH + 0x7f)
+#define LZ_HASHBITS   12
+#define LZ_HASHSZ     (1 << LZ_HASHBITS)
+#define LZ_SEGSZ      16            // dictionary training segment size
+
+/*
+ * Bloom filter. pathname.blm starts with a header holding the size
+ * of the filter of one hash chain, followed by the filters of every
+ * chain, in chain order; a key sets BLOOM_K bits in the filter of
+ * its own chain. A clear bit means the key is not in the chain.
+ * A new database gets BLOOM_SZ bytes per chain; db_bloom resizes
+ * the filters to BLOOM_BITS bits per record.
+ */
+#define BLOOM_SZ    32              // bytes per hash chain of a new database
+#define BLOOM_MAX   (1 << 20)       // max bytes per hash chain
+#define BLOOM_BITS  10              // bits per record when db_bloom sizes it
+#define BLOOM_K     3               // bits set per key
+#define BLMHDR_SZ   8               // header: "%7d\n" bytes per hash chain
+
+/*
+ * Shared-memory directory. Once pathname.shm exists every handle
+ * maps it and uses its process-shared, robust mutexes as the hash
+ * chain locks, and its copies of the chain heads instead of reading
+ * the hash table, so neither needs a system call. The index file is
+ * still written through and remains the real data.
+ *
+ * Every handle that maps pathname.shm holds a read lock on its byte
+ * SHM_ATTACH_OFF until it is closed. The first one to attach (after
+ * all others were closed, crashed or the system was rebooted), seen
+ * under a write lock on byte SHM_INIT_OFF, rebuilds the directory.
+ */
+#define SHM_MAGIC      "\003SHM"
+#define SHM_MAGIC_SZ   4
+#define SHM_INIT_OFF   0
+#define SHM_ATTACH_OFF 1
+
+/*
+ * Fault injection for stress testing. Built with -DDB_FAULT, the I/O
+ * and record lock helpers fail with EINTR or transfer only part of
+ * the buffer once in every $DB_FAULT calls on average, so that the
+ * retry paths run as often as the normal ones.
+ */
+#define FAULT_NONE  0
+#define FAULT_EINTR 1
+#define FAULT_SHORT 2
+
+/*
+ * Time-to-live. A data record that expires starts with EXP_MARK
+ * and the expiry time (EXP_SZ ASCII chars, seconds since the Epoch,
+ * 0 for never).
+ */
+#define EXP_MARK    '\002'
+#define EXP_SZ      12
+#define EXP_HDR_SZ  (1 + EXP_SZ)
+#define EXP_MAX     999999999999LL  // largest expiry time in EXP_SZ chars
+
+/*
+ * Expiry index. pathname.exp is a timing wheel of EXPB_N lists; an
+ * entry for a record expiring at time t goes on list (t / EXPB_W) %
+ * EXPB_N. The header holds the cursor (the first bucket t / EXPB_W
+ * not yet swept), the number of bytes of entries already swept and
+ * the list heads, then a newline. Entries are only appended:
+ * "prev expire key\n", prev being the offset of the next entry on the
+ * same list, 0 at the end. Adding an entry and moving the cursor
+ * write lock the cursor field; a sweep write locks the newline while
+ * it reads the lists. A store that only puts off the expiry time of
+ * a record adds no entry: the sweep finds the record unexpired at the
+ * old time and links an entry for the new one.
+ */
+#define EXPB_W       1              // seconds per bucket
+#define EXPB_N       4096           // lists, over an hour around the wheel
+#define EXPPTR_SZ    12             // size of offsets in the expiry index
+#define EXPCUR_OFF   0              // cursor offset in the expiry index
+#define EXPGARB_OFF  (EXPCUR_OFF + EXPPTR_SZ + 1)
+#define EXPHEAD_OFF  (EXPGARB_OFF + EXPPTR_SZ + 1)
+#define EXPHDR_SZ    (EXPHEAD_OFF + EXPB_N * EXPPTR_SZ + 1)
+#define EXPSWEEP_OFF (EXPHDR_SZ - 1)
+#define EXPENT_MAX   (EXPPTR_SZ + EXP_SZ + IDXLEN_MAX + 3)
+
+/*
+ * Change feed. pathname.log starts with the next sequence number and
+ * the committed length of the file (SEQ_SZ ASCII chars each, a space
+ * and a newline), followed by one record per mutation:
+ * "seq:op:keylen:datlen:expire\n", the key, the data and a newline.
+ * The op of all but the last operation of a transaction is lower case.
+ * The header is rewritten in one write after the last operation, so
+ * records past the committed length (a writer died) are never read
+ * and are overwritten by the next writer.
+ * All shards of a sharded database share the feed FEED_NAME.log in
+ * its directory, so a transaction is one unit in the feed.
+ */
+#define SEQ_SZ      12
+#define FEEDHDR_SZ  (2 * SEQ_SZ + 2)
+#define FEED_NAME   "feed"
+#define LOG_STORE   'S'
+#define LOG_DELETE  'D'
+#define LOGHDR_MAX  48          // longest record header
+#define LOGREC_MAX  (LOGHDR_MAX + IDXLEN_MAX + DATLEN_MAX)
+
 typedef unsigned long DBHASH;   // hash values
 typedef unsigned long COUNT;    // unsigned counter
 
 /*
- * Library's private representation of the database.
+ * One db_store or db_delete buffered between db_txn_begin
+ * and db_txn_commit.
+ */
+typedef struct {
+    char   *key;            // malloc'ed copy of key
+    char   *data;           // malloc'ed encoded data, NULL for delete
+    char   *value;          // malloc'ed copy of data for the change feed
+    int    flag;            // db_store flag, 0 for delete; of the first
+                            //   operation on key, which the record must meet
+    int    rc;              // result of a later operation on key that fails
+                            //   after the earlier ones, 0 if none
+    time_t expire;          // expiry time, 0 for never
+    int    shardno;         // shard holding key, 0 if not sharded
+    size_t datlen;          // length of data (encoded, without newline)
+    struct _db *db;         // DB (or shard) holding key
+    off_t  chainoff;        // offset of hash chain for key
+    int    append;          // must be appended at commit
+    int    expadd;          // needs an entry in the expiry index
+    off_t  idxoff;          // offset of appended index record
+} DBTXNOP;
+
+/*
+ * One entry of the expiry index, read by db_expire.
+ */
+typedef struct {
+    off_t  next;            // offset of next entry on the list, 0 at end
+    time_t expire;          // expiry time
+    char   *key;            // key of the record
+    size_t len;             // length of the entry, including newline
+} DBEXP;
+
+/*
+ * One hash chain in the shared-memory directory.
+ */
+typedef struct {
+    pthread_mutex_t lock;   // hash chain lock
+    off_t           head;   // copy of the hash chain pointer
+} DBCHAIN;
+
+/*
+ * Layout of pathname.shm.
  */
 typedef struct {
+    char    magic[SHM_MAGIC_SZ];
+    DBHASH  nhash;          // size of chain[]
+    DBCHAIN chain[];
+} DBSHM;
+
+/*
+ * Library's private representation of the database.
+ */
+typedef struct _db {
     int    idxfd;           // fd for index file
     int    datfd;           // fd for data file
+    int    logfd;           // fd for change feed, -1 if none
+    int    expfd;           // fd for expiry index, -1 if none
+    unsigned char *bloom;   // mapped pathname.blm, NULL if none
+    size_t blmsz;           // bytes per hash chain of the Bloom filter
+    int    shmfd;           // fd for shared directory, -1 if none
+    DBSHM  *shm;            // mapped shared directory, NULL if none
+    struct _db *next;       // next in handle pool or cache
+    size_t namesz;          // size of name buffer
+    int    accmode;         // O_ACCMODE part of db_open flags
+    dev_t  dev;             // device and i-nodes of the files,
+    ino_t  idxino;          //   recorded when the handle is cached,
+    ino_t  datino;          //   0 for a file the handle doesn't use
+    ino_t  logino;
+    ino_t  expino;
+    ino_t  blmino;          // recorded when the filter is mapped
+    ino_t  shmino;
+    long long gen;          // generation of the index file
     char   *idxbuf;         // malloc'ed buffer for index record
     char   *datbuf;         // malloc'ed buffer for data record
     char   *name;           // name db was opened under
@@ -49,21 +299,50 @@ typedef struct {
     off_t  datoff;          // offset in data file of data record
     size_t datlen;          // length of data record
                             // includes newline at end
+    time_t expire;          // expiry time of data record, 0 for never
     off_t  ptrval;          // contents of chain ptr in index record
     off_t  ptroff;          // chain ptr offset pointing to this idx record
     off_t  chainoff;        // offset of hash chain for this index record
     off_t  hashoff;         // offset in index file of hash table
+    off_t  recoff;          // offset in index file of first index record
     DBHASH nhash;           // current hash table size
+    struct _db **shard;     // shards of a sharded database, else NULL
+    int    nshard;          // number of shards, 0 if not sharded
+    int    curshard;        // shard being scanned by db_nextrec
+    unsigned char *linked;  // malloc'ed bitmap of the index records on a hash
+                            //   chain when db_nextrec began the scan, or NULL
+    off_t  nlinked;         // number of offsets the bitmap covers
+    int    intxn;           // between db_txn_begin and commit/abort
+    DBTXNOP *txnop;         // malloc'ed array of buffered operations
+    int    ntxnop;          // number of buffered operations
+    int    maxtxnop;        // allocated size of txnop
+    char   *cmpbuf;         // malloc'ed dictionary + compression window
+                            // NULL if the database is not compressed
+    char   *encbuf;         // malloc'ed buffer for an encoded data record
+    unsigned short *dicthash;   // malloc'ed match table of the dictionary
+    size_t dictlen;         // length of dictionary at front of cmpbuf
+    size_t cmpmin;          // values shorter than this are stored raw
+    struct _db *logdb;      // handle owning the change feed: this one,
+                            //   or the sharded database it belongs to
+    long long logseq;       // next sequence number of the change feed
+    off_t  logoff;          // committed length of the change feed
+    int    inlog;           // change feed header locked
     COUNT  cnt_delok;       // delete OK
     COUNT  cnt_delerr;      // delete error
     COUNT  cnt_fetchok;     // fetch OK
     COUNT  cnt_fetcherr;    // fetch error
+    COUNT  cnt_bloomneg;    // fetch/delete answered by Bloom filter
     COUNT  cnt_nextrec;     // nextrec
     COUNT  cnt_stor1;       // store: DB_INSERT, no empty, appended
     COUNT  cnt_stor2;       // store: DB_INSERT, found empty, reused
     COUNT  cnt_stor3;       // store: DB_REPLACE, diff len, appended
     COUNT  cnt_stor4;       // store: DB_REPLACE, same len, overwrote
     COUNT  cnt_storerr;     // store error
+    COUNT  cnt_txnok;       // transaction committed
+    COUNT  cnt_txnerr;      // transaction failed or aborted
+    COUNT  cnt_cmpin;       // value bytes passed to db_store
+    COUNT  cnt_cmpout;      // value bytes written after compression
+    COUNT  cnt_expired;     // expired records reclaimed
 } DB;
 
 /*
@@ -75,6 +354,29 @@ typedef struct {
  */
 static DB *_db_alloc(int);
 
+/*
+ * Open (and if necessary initialize) a single index file
+ * and data file pair: pathname.idx and pathname.dat.
+ */
+static DB *_db_openfile(const char *, int, int);
+
+/*
+ * Open a sharded database: the file pairs named 0.idx/0.dat ...
+ * inside the directory pathname.
+ */
+static DB *_db_openshards(const char *, int, int);
+
+/*
+ * Read the number of shards recorded in a directory, first recording
+ * the given number if it is > 0 and the directory has none yet.
+ */
+static int _db_nshard(const char *, int, int);
+
+/*
+ * Return the index of the shard of a sharded database that holds key.
+ */
+static int _db_shard(DB *, const char *);
+
 /*
  * Delete the current record specified by the DB structure.
  * This function is called by db_delete and db_store, after
@@ -82,12 +384,25 @@ static DB *_db_alloc(int);
  */
 static void _db_dodelete(DB *);
 
+/*
+ * Store a record with an expiry time (0 for never). Does the
+ * work of db_store and db_store_ttl.
+ */
+static int _db_store(DB *, const char *, const char *, int, time_t);
+
 /*
  * Find the specified record. Called by db_delete, db_fetch,
  * and db_store. Returns with the hash chain locked.
  */
 static int _db_find_and_lock(DB *, const char *, int);
 
+/*
+ * Search the hash chain of key for the record, the chain must
+ * already be locked by the caller. Used by _db_find_and_lock
+ * and db_txn_commit.
+ */
+static int _db_find(DB *, const char *);
+
 /*
  * Try to find a free index record and accompanying data record
  * of the correct sizes. We're only called by db_store.
@@ -97,6 +412,7 @@ static int _db_findfree(DB *, int, int);
 /*
  * Free up a DB structure, and all the malloc'ed buffers it
  * may point to. Also close the file descriptors if still open.
+ * The struct and its fixed-size buffers go back to the pool.
  */
 static void _db_free(DB *);
 
@@ -131,7 +447,7 @@ static off_t _db_readptr(DB *, off_t);
  * Write a data record. Called by _db_dodelete (to write
  * the record with blanks) and db_store.
  */
-static void _db_writedat(DB *, const char *, off_t, int);
+static void _db_writedat(DB *, const char *, size_t, off_t, int);
 
 /*
  * Write an index record. _db_writedat is called before
@@ -140,6 +456,279 @@ static void _db_writedat(DB *, const char *, off_t, int);
  */
 static void _db_writeidx(DB *, const char *, off_t, int, off_t);
 
+/*
+ * Buffer a db_store (data != NULL) or db_delete (data == NULL)
+ * issued between db_txn_begin and db_txn_commit.
+ */
+static int _db_txn_add(DB *, const char *, const char *, int, time_t);
+
+/*
+ * Order buffered operations by shard and hash chain, the order
+ * in which db_txn_commit locks the chains.
+ */
+static int _db_txn_cmp(const void *, const void *);
+
+/*
+ * Append the data and index records of all operations marked
+ * append, with one write to each file. Called by db_txn_commit
+ * with the chains of the operations locked.
+ */
+static void _db_txn_append(DB *, DBTXNOP *, int);
+
+/*
+ * Release the buffered operations of a transaction.
+ */
+static void _db_txn_free(DB *);
+
+/*
+ * If the data file starts with a dictionary header, load the
+ * dictionary and set up the compression buffers.
+ */
+static void _db_loaddict(DB *);
+
+/*
+ * Build a dictionary of at most the given size from sample values.
+ * Returns the dictionary length.
+ */
+static size_t _db_train(const char **, int, char *, size_t);
+
+/*
+ * Encode a value and its expiry time for the data file. Returns
+ * the value itself when there is nothing to add, else a record
+ * built in db->encbuf.
+ */
+static const char *_db_encode(DB *, const char *, time_t, size_t *);
+
+/*
+ * Decode a data record of a compressed database (after any expiry
+ * time). Returns a pointer to the null-terminated value.
+ */
+static char *_db_decode(DB *, char *, size_t);
+
+/*
+ * LZ77 codec working in db->cmpbuf, after the dictionary.
+ */
+static unsigned int _db_lzhash(const char *);
+static size_t _db_lzenc(DB *, size_t, char *, size_t);
+static ssize_t _db_lzdec(DB *, const char *, size_t, size_t);
+
+/*
+ * Append a mutation to the change feed, if the database has one.
+ * Called with the hash chain of key write locked.
+ */
+static void _db_log(DB *, int, const char *, const char *, time_t, int);
+
+/*
+ * Take a handle for pathname out of the cache, or drop all of them
+ * when the database is to be truncated.
+ */
+/*
+ * Mark the index records on every hash chain for db_nextrec,
+ * taking the chain read locks one at a time.
+ */
+static void _db_linkmap(DB *);
+
+static DB *_db_cachefind(const char *, int);
+
+/*
+ * Tell whether the files of a cached handle (pathname has len bytes)
+ * were replaced or rebuilt, or a sidecar appeared or went away.
+ */
+static int _db_cachestale(DB *, size_t);
+
+/*
+ * Read the generation of the index file, 0 if the header is short.
+ */
+static long long _db_readgen(DB *);
+
+/*
+ * Detach the least recently used handles beyond the cache limit.
+ * Called with the pool lock held; returns the list to free.
+ */
+static DB *_db_cachetrim(void);
+
+/*
+ * Put a closed handle in the cache, or free it.
+ */
+static void _db_release(DB *);
+
+/*
+ * Drop the handles inherited from the parent in a child process,
+ * and keep the pool lock consistent across fork.
+ */
+static void _db_atfork(void);
+static void _db_prefork(void);
+static void _db_postfork(void);
+static void _db_childfork(void);
+
+/*
+ * Map the Bloom filter, creating and clearing it when the database
+ * has just been initialized.
+ */
+static void _db_bloom_open(DB *, int, int);
+
+/*
+ * Map the Bloom filter of blmsz bytes per hash chain from fd,
+ * sizing and clearing the file first if the last argument is
+ * nonzero. Returns -1 on error.
+ */
+static int _db_bloom_map(DB *, int, int, size_t, int);
+
+/*
+ * Set or test the Bloom filter bits of key in the filter of the
+ * hash chain it belongs to. A database without a filter tests
+ * true for every key.
+ */
+static void _db_bloom_add(DB *, const char *);
+static int _db_bloom_test(DB *, const char *);
+
+/*
+ * Test the BLOOM_K bits of key in one chain's filter of the given
+ * size, setting them too if the last argument is nonzero.
+ */
+static int _db_bloom_probe(unsigned char *, size_t, const char *, int);
+
+/*
+ * Map the shared-memory directory from an open pathname.shm,
+ * rebuilding it from the index file when no other handle uses it.
+ */
+static int _db_shm_attach(DB *, int);
+
+/*
+ * Copy one chain head from the index file to the shared directory.
+ */
+static void _db_shm_reload(DB *, DBHASH);
+
+/*
+ * Lock and unlock a hash chain, through the shared directory if the
+ * database has one, else with a record lock on the index file.
+ */
+static void _db_lockchain(DB *, off_t, int);
+static void _db_unlockchain(DB *, off_t);
+
+/*
+ * Lock and unlock every hash chain of the shared directory, for the
+ * whole-file barriers. Does nothing without a shared directory.
+ */
+static void _db_lockall(DB *);
+static void _db_unlockall(DB *);
+
+/*
+ * Add an entry for a record stored with a TTL to the expiry index.
+ */
+static void _db_expadd(DB *, const char *, time_t);
+
+/*
+ * Tell whether storing a record with an expiry time needs a new entry
+ * in the expiry index, given the expiry time of the unexpired record
+ * it replaces (0 if none).
+ */
+static int _db_expneed(time_t, time_t);
+
+/*
+ * Link an entry into the expiry index, on the list of its bucket but
+ * not before the cursor. Called with the cursor locked.
+ */
+static void _db_explink(DB *, off_t, const char *, time_t);
+
+/*
+ * Open the expiry index, creating it if asked to. Returns -1 if
+ * there is none.
+ */
+static int _db_expopen(DB *, int);
+
+/*
+ * Read the cursor of the expiry index, writing the header first if
+ * the index was just created. Called with the cursor locked.
+ */
+static off_t _db_expcursor(DB *);
+
+/*
+ * Read or write a field of the expiry index header.
+ */
+static off_t _db_expreadptr(DB *, off_t);
+static void _db_expwriteptr(DB *, off_t, off_t);
+
+/*
+ * Read the expiry index entry at an offset into a DBEXP, with the
+ * key in a buffer of IDXLEN_MAX + 1 bytes. Returns -1 if it is torn.
+ */
+static int _db_expread(DB *, off_t, DBEXP *, char *);
+
+/*
+ * Rewrite the live entries of the expiry index to the front of the
+ * file and truncate it. Called with the cursor and the sweep locked.
+ */
+static void _db_expcompact(DB *);
+
+/*
+ * Check whether the record found by _db_find has expired, reading
+ * only the expiry time at the front of the data record.
+ */
+static int _db_expired(DB *);
+
+/*
+ * Convert the EXP_MARK and expiry time at the front of a data
+ * record.
+ */
+static time_t _db_getexpire(const char *);
+
+/*
+ * Copy a whole file for db_snapshot, as a reflink where the
+ * file system supports it.
+ */
+static int _db_clone(int, int);
+
+/*
+ * Parse one index record for db_check without dumping core on bad
+ * data. Returns -1 if the record, its place in the chain or its
+ * data record is invalid.
+ */
+static int _db_checkrec(DB *, off_t, DBHASH, off_t, off_t *);
+
+/*
+ * Set or release a record lock, with DB_SETLK or DB_SETLKW.
+ */
+static int _db_lockreg(int, int, int, off_t, int, off_t);
+
+#define _db_trylock(fd, type, offset, whence, len) \
+            _db_lockreg((fd), DB_SETLK, (type), (offset), (whence), (len))
+#define _db_unlock(fd, offset, whence, len) \
+            _db_lockreg((fd), DB_SETLK, F_UNLCK, (offset), (whence), (len))
+
+/*
+ * Wait for a record lock, waiting again when a signal interrupts.
+ */
+static int _db_lockw(int, int, off_t, int, off_t);
+
+/*
+ * Turn the OPEN_OFF read lock of a handle into a write lock, failing
+ * with EBUSY while any other handle is open (EBADF for a read-only
+ * handle), and back again. Used by the calls that change how every
+ * handle must access the database.
+ */
+static int _db_lockexcl(DB *);
+static void _db_unlockexcl(DB *);
+
+/*
+ * Read or write the whole buffer, retrying after EINTR and short
+ * transfers. An offset < 0 means the current file offset, else the
+ * file offset is not changed. Reads stop early only at end of file.
+ */
+static ssize_t _db_readn(int, void *, size_t, off_t);
+static ssize_t _db_writen(int, const void *, size_t, off_t);
+static ssize_t _db_readv(int, struct iovec *, int);
+static ssize_t _db_writev(int, struct iovec *, int);
+
+/*
+ * Pick the fault to inject into the next call, if any.
+ */
+#ifdef DB_FAULT
+static int _db_fault(void);
+#else
+#define _db_fault() FAULT_NONE
+#endif
+
 /*
  * Write a chain ptr field somewhere in the index file:
  * the free list, the hash table, or in an index record.
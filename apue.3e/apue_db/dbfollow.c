@@ -0,0 +1,97 @@
+#include "apue.h"
+#include "apue_db.h"
+#include <fcntl.h>
+#include <limits.h>     // for PATH_MAX
+
+/*
+ * Keep a replica on the same machine current by tailing the change
+ * feed of the primary database:
+ *
+ *     dbfollow primary replica [seconds]
+ *
+ * The primary must have its feed turned on with db_feed. The position
+ * reached in the feed is saved in replica.pos, so dbfollow can be
+ * stopped and restarted at any time.
+ */
+
+static off_t     off;
+static long long seq;
+
+static void loadpos(const char *);
+static void savepos(const char *);
+
+int main(int argc, char *argv[])
+{
+    DBHANDLE    db;
+    char        name[PATH_MAX];
+    int         n, interval, sharded;
+    struct stat statbuff;
+
+    if (argc != 3 && argc != 4) {
+        err_quit("usage: dbfollow primary replica [seconds]");
+    }
+    interval = argc == 4 ? atoi(argv[3]) : 1;
+
+    // 分片数据库的所有分片共用目录中的一个变更流
+    sharded = stat(argv[1], &statbuff) == 0 && S_ISDIR(statbuff.st_mode);
+    if (sharded) {
+        snprintf(name, sizeof(name), "%s/feed.log", argv[1]);
+    } else {
+        snprintf(name, sizeof(name), "%s.log", argv[1]);
+    }
+    if (access(name, R_OK) < 0) {
+        err_quit("dbfollow: %s has no change feed", argv[1]);
+    }
+
+    // 副本不存在时建立它, 是否分片与主数据库相同
+    if ((db = db_open(argv[2], O_RDWR)) == NULL &&
+        (db = db_open(argv[2], O_RDWR | O_CREAT | O_TRUNC | (sharded ? O_DIRECTORY : 0),
+                      FILE_MODE)) == NULL) {
+        err_sys("dbfollow: db_open error for %s", argv[2]);
+    }
+    loadpos(argv[2]);
+
+    for ( ; ; ) {
+        if ((n = db_feed_apply(db, argv[1], &off, &seq)) < 0) {
+            err_sys("dbfollow: db_feed_apply error for %s after sequence %lld", argv[1], seq);
+        }
+        if (n > 0) {
+            savepos(argv[2]);
+        }
+        sleep(interval);
+    }
+}
+
+static void loadpos(const char *replica)
+{
+    char      name[PATH_MAX];
+    FILE      *fp;
+    long long o, s;
+
+    snprintf(name, sizeof(name), "%s.pos", replica);
+    if ((fp = fopen(name, "r")) == NULL) {
+        return;     // start from the beginning of the feed
+    }
+    if (fscanf(fp, "%lld %lld", &o, &s) == 2) {
+        off = o;
+        seq = s;
+    }
+    fclose(fp);
+}
+
+static void savepos(const char *replica)
+{
+    char name[PATH_MAX], tmp[PATH_MAX];
+    FILE *fp;
+
+    // 先写临时文件再改名, 中途退出也不会留下不完整的位置文件
+    snprintf(name, sizeof(name), "%s.pos", replica);
+    snprintf(tmp, sizeof(tmp), "%s.pos.tmp", replica);
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        err_sys("dbfollow: can't create %s", tmp);
+    }
+    fprintf(fp, "%lld %lld\n", (long long)off, seq);
+    if (fclose(fp) != 0 || rename(tmp, name) < 0) {
+        err_sys("dbfollow: can't write %s", name);
+    }
+}
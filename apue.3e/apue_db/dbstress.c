@@ -0,0 +1,586 @@
+#include "apue.h"
+#include "apue_db.h"
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+/*
+ * Stress test. Worker processes, each running several threads with
+ * a handle of their own, do a random mix of stores, deletes, fetches,
+ * transactions, expiring stores, db_expire and scans on one database,
+ * while the parent SIGKILLs a worker now and then, runs db_check and
+ * starts a new worker in its place:
+ *
+ *     dbstress [-d] [-c] [-m] [-p nproc] [-t nthread] [-k msec] pathname [seconds]
+ *
+ * -d creates a sharded database, -c a compressed one, and -m turns on
+ * the shared-memory directory; -k is the mean time between kills
+ * (0 for none). Every thread owns NKEY keys and keeps the version each
+ * of them should hold in shared memory, so the model outlives a killed
+ * worker: the keys of the operation it was in the middle of must hold
+ * the old version, the new one, or nothing (a replace deletes before it
+ * appends). The threads also share NHOT keys, some of them expiring,
+ * whose values are only checked to be well formed.
+ *
+ * Linked with db.c built with -DDB_FAULT, the library also injects
+ * EINTR and short I/O once in every $DB_FAULT calls (100 unless set).
+ * Workers pause while db_check runs. The throughput is reported every
+ * second. The exit status is 1 if db_check finds damage or the
+ * database disagrees with the model.
+ */
+
+#define NKEY     256    // keys owned by every thread
+#define NHOT     16     // keys shared by all threads
+#define TXN_MAX  8      // operations in one transaction
+#define SCAN_MAX 64     // records read by one scan
+#define VAL_MAX  512    // longest value, with null
+
+/*
+ * What the keys of one thread should hold, in shared memory.
+ */
+typedef struct {
+    int       ver[NKEY];        // version stored under each key, 0 if none
+    int       lastver;          // last version used
+    int       npend;            // keys of the operation in progress
+    int       pend[TXN_MAX];
+    int       pendver[TXN_MAX]; // version being stored, 0 for delete
+    long long nops;             // operations done
+} MODEL;
+
+typedef struct {
+    int   stop;                 // set by the parent at the end
+    int   pause;                // set while the parent runs db_check
+    int   nfail;                // mismatches found by the workers
+    MODEL model[];              // nproc * nthread
+} SHARED;
+
+static volatile SHARED *shared;
+static const char      *path;
+static int             nproc = 4, nthread = 4;
+
+static pid_t  spawn(int);
+static void   worker(int);
+static void   *run(void *);
+static void   recover(DBHANDLE, int);
+static int    dostore(DBHANDLE, volatile MODEL *, int, unsigned int *);
+static int    dodelete(DBHANDLE, volatile MODEL *, int, unsigned int *);
+static int    dofetch(DBHANDLE, volatile MODEL *, int, unsigned int *);
+static int    dohot(DBHANDLE, volatile MODEL *, unsigned int *);
+static int    dotxn(DBHANDLE, volatile MODEL *, int, unsigned int *);
+static int    doscan(DBHANDLE);
+static int    check(const char *);
+static int    verify(void);
+static void   makekey(char *, int, int);
+static void   makeval(char *, const char *, int);
+static int    parsever(const char *, const char *);
+static void   fail(const char *, ...);
+static double now(void);
+
+int main(int argc, char *argv[])
+{
+    DBHANDLE    db;
+    pid_t       *pids, pid;
+    int         c, i, status, seconds = 10, killms = 500, oflag = 0, cflag = 0, mflag = 0;
+    int         nkill = 0, ncheck = 0, nbad = 0;
+    long long   ops, lastops = 0;
+    double      start, t, lastt, nextkill;
+    size_t      size;
+    const char  *samples[] = { "k0.0=1:aaaaaaaaaaaaaaaa", "hot0=2:bbbbbbbbbbbbbbbb" };
+
+    while ((c = getopt(argc, argv, "dcmp:t:k:")) != -1) {
+        switch (c) {
+        case 'd': oflag = O_DIRECTORY;      break;
+        case 'c': cflag = 1;                break;
+        case 'm': mflag = 1;                break;
+        case 'p': nproc = atoi(optarg);     break;
+        case 't': nthread = atoi(optarg);   break;
+        case 'k': killms = atoi(optarg);    break;
+        default:  exit(2);
+        }
+    }
+    if (optind != argc - 1 && optind != argc - 2) {
+        err_quit("usage: dbstress [-d] [-c] [-m] [-p nproc] [-t nthread] [-k msec] pathname [seconds]");
+    }
+    path = argv[optind];
+    if (optind == argc - 2) {
+        seconds = atoi(argv[optind + 1]);
+    }
+    if (nproc < 1 || nthread < 1) {
+        err_quit("dbstress: need at least one process and one thread");
+    }
+    setenv("DB_FAULT", "100", 0);
+
+    // 建立数据库; 压缩和共享内存目录都要在其他句柄打开之前启用
+    if ((db = db_open(path, O_RDWR | O_CREAT | O_TRUNC | oflag, FILE_MODE)) == NULL) {
+        err_sys("dbstress: db_open error for %s", path);
+    }
+    if (cflag && db_compress(db, samples, 2, 16) < 0) {
+        err_sys("dbstress: db_compress error");
+    }
+    if (mflag && db_shm(db) < 0) {
+        err_sys("dbstress: db_shm error");
+    }
+    db_close(db);
+
+    // 模型放在共享内存中, 工作进程被杀死后仍然保留
+    size = sizeof(SHARED) + nproc * nthread * sizeof(MODEL);
+    if ((shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        err_sys("dbstress: mmap error");
+    }
+    if ((pids = calloc(nproc, sizeof(pid_t))) == NULL) {
+        err_sys("dbstress: calloc error");
+    }
+    for (i = 0; i < nproc; i++) {
+        pids[i] = spawn(i);
+    }
+
+    srand(getpid());
+    start = lastt = now();
+    nextkill = start + (killms > 0 ? rand() % (2 * killms) / 1000.0 : seconds);
+    while ((t = now()) < start + seconds) {
+        usleep(10000);
+
+        // 工作进程自己退出说明库出错或发现了不一致, 记下后重新启动
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (i = 0; i < nproc && pids[i] != pid; i++)
+                ;
+            if (i < nproc) {
+                fail("worker %d %s %d", i, WIFSIGNALED(status) ? "killed by signal" : "exited with status",
+                     WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+                pids[i] = spawn(i);
+            }
+        }
+
+        // 在随机的时刻杀死一个工作进程, 它可能正在修改数据库. 记录锁不保证公平,
+        // 其他线程不停地修改时 db_check 可能长时间等不到锁, 检查期间让它们暂停
+        if (killms > 0 && t >= nextkill) {
+            i = rand() % nproc;
+            kill(pids[i], SIGKILL);
+            waitpid(pids[i], NULL, 0);
+            nkill++;
+            shared->pause = 1;
+            ncheck++;
+            nbad += check("after SIGKILL");
+            shared->pause = 0;
+            pids[i] = spawn(i);
+            nextkill = t + rand() % (2 * killms) / 1000.0;
+        }
+
+        if (t - lastt >= 1.0) {
+            for (ops = 0, i = 0; i < nproc * nthread; i++) {
+                ops += shared->model[i].nops;
+            }
+            printf("%6.1f s %10.0f ops/s %6d kills\n", t - start, (ops - lastops) / (t - lastt), nkill);
+            fflush(stdout);
+            lastops = ops;
+            lastt = t;
+        }
+    }
+
+    // 让工作进程完成手头的操作后退出, 然后检查结构并与模型比较
+    shared->stop = 1;
+    for (i = 0; i < nproc; i++) {
+        if (waitpid(pids[i], &status, 0) == pids[i] && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+            fail("worker %d %s %d", i, WIFSIGNALED(status) ? "killed by signal" : "exited with status",
+                 WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+        }
+    }
+    t = now();
+    ncheck++;
+    nbad += check("at the end");
+    nbad += verify();
+
+    for (ops = 0, i = 0; i < nproc * nthread; i++) {
+        ops += shared->model[i].nops;
+    }
+    printf("%lld operations in %.1f s, %.0f ops/s, %d processes x %d threads, %d kills, %d checks\n",
+           ops, t - start, ops / (t - start), nproc, nthread, nkill, ncheck);
+    if (nbad > 0 || shared->nfail > 0) {
+        printf("FAILED: %d mismatches, %d damaged checks\n", shared->nfail, nbad);
+        exit(1);
+    }
+    exit(0);
+}
+
+static pid_t spawn(int slot)
+{
+    pid_t pid;
+
+    fflush(stdout);     // the child must not print the parent's buffer again
+    if ((pid = fork()) < 0) {
+        err_sys("dbstress: fork error");
+    } else if (pid == 0) {
+        worker(slot);
+    }
+    return pid;
+}
+
+static void worker(int slot)
+{
+    DBHANDLE  db;
+    pthread_t *tid;
+    int       i, err;
+
+    // 先根据前一个被杀死的进程留下的未完成操作修正模型, 再启动线程
+    db_cache(4);
+    if ((db = db_open(path, O_RDWR)) == NULL) {
+        err_sys("dbstress: db_open error for %s", path);
+    }
+    for (i = 0; i < nthread; i++) {
+        recover(db, slot * nthread + i);
+    }
+    db_close(db);
+
+    if ((tid = calloc(nthread, sizeof(pthread_t))) == NULL) {
+        err_sys("dbstress: calloc error");
+    }
+    for (i = 0; i < nthread; i++) {
+        if ((err = pthread_create(&tid[i], NULL, run, (void *)(intptr_t)(slot * nthread + i))) != 0) {
+            err_exit(err, "dbstress: pthread_create error");
+        }
+    }
+    for (i = 0; i < nthread; i++) {
+        pthread_join(tid[i], NULL);
+    }
+    exit(0);
+}
+
+static void *run(void *arg)
+{
+    int           id = (intptr_t)arg, r, rc = 0;
+    unsigned int  seed = getpid() ^ (id << 16) ^ time(NULL);
+    volatile MODEL *m = &shared->model[id];
+    DBHANDLE      db;
+
+    if ((db = db_open(path, O_RDWR)) == NULL) {
+        err_sys("dbstress: db_open error for %s", path);
+    }
+    while (!shared->stop && rc == 0) {
+        if (shared->pause) {
+            usleep(1000);
+            continue;
+        }
+        r = rand_r(&seed) % 100;
+        if (r < 30) {
+            rc = dostore(db, m, id, &seed);
+        } else if (r < 45) {
+            rc = dodelete(db, m, id, &seed);
+        } else if (r < 75) {
+            rc = dofetch(db, m, id, &seed);
+        } else if (r < 88) {
+            rc = dohot(db, m, &seed);
+        } else if (r < 95) {
+            rc = dotxn(db, m, id, &seed);
+        } else if (r < 97) {
+            // 关闭再打开, 句柄从缓存中取回
+            db_close(db);
+            if ((db = db_open(path, O_RDWR)) == NULL) {
+                err_sys("dbstress: db_open error for %s", path);
+            }
+        } else if (r < 98) {
+            if (db_expire(db, 32) < 0) {
+                fail("db_expire error");
+                rc = -1;
+            }
+        } else {
+            rc = doscan(db);
+        }
+        m->nops++;
+    }
+    db_close(db);
+    return NULL;
+}
+
+static void recover(DBHANDLE db, int id)
+{
+    volatile MODEL *m = &shared->model[id];
+    char           key[IDXLEN_MAX];
+    char           *ptr;
+    int            i, k, v;
+
+    // 被杀死时正在操作的键只能是原来的版本, 新的版本, 或者不存在
+    for (i = 0; i < m->npend; i++) {
+        k = m->pend[i];
+        makekey(key, id, k);
+        ptr = db_fetch(db, key);
+        v = ptr == NULL ? 0 : parsever(key, ptr);
+        if (v < 0 || (v != 0 && v != m->ver[k] && v != m->pendver[i])) {
+            fail("%s holds [%s] after SIGKILL, expected version %d or %d", key, ptr ? ptr : "", m->ver[k], m->pendver[i]);
+        }
+        m->ver[k] = v < 0 ? 0 : v;
+    }
+    m->npend = 0;
+}
+
+static int dostore(DBHANDLE db, volatile MODEL *m, int id, unsigned int *seed)
+{
+    char key[IDXLEN_MAX], val[VAL_MAX];
+    int  k = rand_r(seed) % NKEY, flag = 1 + rand_r(seed) % 3, ver, rc, expect;
+
+    makekey(key, id, k);
+    ver = ++m->lastver;
+    makeval(val, key, ver);
+    if (flag == DB_INSERT && m->ver[k] != 0) {
+        expect = 1;
+    } else if (flag == DB_REPLACE && m->ver[k] == 0) {
+        expect = -1;
+    } else {
+        expect = 0;
+    }
+
+    // 先记下正在进行的操作, 进程在调用中被杀死时由 recover 处理
+    m->pend[0] = k;
+    m->pendver[0] = ver;
+    m->npend = 1;
+    if (rand_r(seed) % 10 == 0) {
+        rc = db_store_ttl(db, key, val, flag, 3600);
+    } else {
+        rc = db_store(db, key, val, flag);
+    }
+    if (rc == 0) {
+        m->ver[k] = ver;
+    }
+    m->npend = 0;
+    if (rc != expect) {
+        fail("db_store %s flag %d returned %d, expected %d", key, flag, rc, expect);
+        return -1;
+    }
+    return 0;
+}
+
+static int dodelete(DBHANDLE db, volatile MODEL *m, int id, unsigned int *seed)
+{
+    char key[IDXLEN_MAX];
+    int  k = rand_r(seed) % NKEY, rc, expect;
+
+    makekey(key, id, k);
+    expect = m->ver[k] != 0 ? 0 : -1;
+    m->pend[0] = k;
+    m->pendver[0] = 0;
+    m->npend = 1;
+    if ((rc = db_delete(db, key)) == 0) {
+        m->ver[k] = 0;
+    }
+    m->npend = 0;
+    if (rc != expect) {
+        fail("db_delete %s returned %d, expected %d", key, rc, expect);
+        return -1;
+    }
+    return 0;
+}
+
+static int dofetch(DBHANDLE db, volatile MODEL *m, int id, unsigned int *seed)
+{
+    char key[IDXLEN_MAX];
+    char *ptr;
+    int  k = rand_r(seed) % NKEY;
+
+    makekey(key, id, k);
+    ptr = db_fetch(db, key);
+    if (m->ver[k] == 0 ? ptr != NULL : ptr == NULL || parsever(key, ptr) != m->ver[k]) {
+        fail("db_fetch %s returned [%s], expected version %d", key, ptr ? ptr : "", m->ver[k]);
+        return -1;
+    }
+    return 0;
+}
+
+static int dohot(DBHANDLE db, volatile MODEL *m, unsigned int *seed)
+{
+    char key[IDXLEN_MAX], val[VAL_MAX];
+    char *ptr;
+    int  r = rand_r(seed) % 3;
+
+    // 所有线程都修改这些键, 只能检查读到的值是完整的; 一部分在 1 秒后过期
+    sprintf(key, "hot%d", rand_r(seed) % NHOT);
+    if (r == 0) {
+        makeval(val, key, ++m->lastver);
+        if (db_store_ttl(db, key, val, DB_STORE, rand_r(seed) % 2) != 0) {
+            fail("db_store_ttl %s error", key);
+            return -1;
+        }
+    } else if (r == 1) {
+        db_delete(db, key);
+    } else if ((ptr = db_fetch(db, key)) != NULL && parsever(key, ptr) < 0) {
+        fail("db_fetch %s returned malformed [%s]", key, ptr);
+        return -1;
+    }
+    return 0;
+}
+
+static int dotxn(DBHANDLE db, volatile MODEL *m, int id, unsigned int *seed)
+{
+    char key[IDXLEN_MAX], val[VAL_MAX];
+    int  n = 2 + rand_r(seed) % (TXN_MAX - 1), step = 1 + rand_r(seed) % (NKEY / TXN_MAX);
+    int  k = rand_r(seed) % NKEY, i, rc, exist = 0, missing = 0, drop;
+    int  flag[TXN_MAX];
+
+    if (db_txn_begin(db) != 0) {
+        fail("db_txn_begin error");
+        return -1;
+    }
+
+    // 事务中的键互不相同, 预期结果只取决于每个操作的前提条件
+    drop = rand_r(seed) % 8 == 0;
+    for (i = 0; i < n; i++) {
+        m->pend[i] = (k + i * step) % NKEY;
+        makekey(key, id, m->pend[i]);
+        if ((flag[i] = rand_r(seed) % 4) == 0) {
+            m->pendver[i] = 0;
+            missing |= m->ver[m->pend[i]] == 0;
+            db_delete(db, key);
+        } else {
+            m->pendver[i] = ++m->lastver;
+            exist |= flag[i] == DB_INSERT && m->ver[m->pend[i]] != 0;
+            missing |= flag[i] == DB_REPLACE && m->ver[m->pend[i]] == 0;
+            makeval(val, key, m->pendver[i]);
+            db_store(db, key, val, flag[i]);
+        }
+    }
+    if (drop) {
+        db_txn_abort(db);
+        return 0;
+    }
+
+    m->npend = n;
+    rc = db_txn_commit(db);
+    if (rc == 0) {
+        for (i = 0; i < n; i++) {
+            m->ver[m->pend[i]] = m->pendver[i];
+        }
+    }
+    m->npend = 0;
+    if (exist || missing ? !((exist && rc == 1) || (missing && rc == -1)) : rc != 0) {
+        fail("db_txn_commit of %d operations returned %d, expected %d", n, rc, exist ? 1 : missing ? -1 : 0);
+        return -1;
+    }
+    return 0;
+}
+
+static int doscan(DBHANDLE db)
+{
+    char key[IDXLEN_MAX];
+    char *ptr;
+    int  i;
+
+    // 其他线程同时在修改, 只检查读到的每条记录都是完整的
+    db_rewind(db);
+    for (i = 0; i < SCAN_MAX && (ptr = db_nextrec(db, key)) != NULL; i++) {
+        if (parsever(key, ptr) < 0) {
+            fail("db_nextrec returned malformed [%s] for %s", ptr, key);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int check(const char *when)
+{
+    DBHANDLE db;
+    int      n;
+
+    if ((db = db_open(path, O_RDWR)) == NULL) {
+        err_sys("dbstress: db_open error for %s", path);
+    }
+    if ((n = db_check(db)) != 0) {
+        printf("db_check %s: %d errors\n", when, n);
+    }
+    db_close(db);
+    return n != 0;
+}
+
+static int verify(void)
+{
+    DBHANDLE       db;
+    volatile MODEL *m;
+    char           key[IDXLEN_MAX];
+    char           *ptr;
+    int            id, k, nmodel = 0, nrec = 0, nbad = 0;
+
+    // 每个键都与模型一致, 数据库中除了共享的键之外没有其他记录
+    if ((db = db_open(path, O_RDONLY)) == NULL) {
+        err_sys("dbstress: db_open error for %s", path);
+    }
+    for (id = 0; id < nproc * nthread; id++) {
+        m = &shared->model[id];
+        for (k = 0; k < NKEY; k++) {
+            makekey(key, id, k);
+            ptr = db_fetch(db, key);
+            if (m->ver[k] == 0 ? ptr != NULL : ptr == NULL || parsever(key, ptr) != m->ver[k]) {
+                printf("%s holds [%s], expected version %d\n", key, ptr ? ptr : "", m->ver[k]);
+                nbad++;
+            }
+            nmodel += m->ver[k] != 0;
+        }
+    }
+    db_rewind(db);
+    while (db_nextrec(db, key) != NULL) {
+        nrec++;
+    }
+    if (nrec < nmodel || nrec > nmodel + NHOT) {
+        printf("db_nextrec found %d records, expected %d to %d\n", nrec, nmodel, nmodel + NHOT);
+        nbad++;
+    }
+    db_close(db);
+    return nbad;
+}
+
+static void makekey(char *key, int id, int k)
+{
+    sprintf(key, "k%d.%d", id, k);
+}
+
+static void makeval(char *val, const char *key, int ver)
+{
+    int n, len;
+
+    // 值中带有键和版本, 长度随版本变化, 填充的字符便于压缩.
+    // 扫描读到的键可能很长, 截断的值与数据库中的值不同, 会被当作错误报告
+    if ((n = snprintf(val, VAL_MAX, "%s=%d:", key, ver)) >= VAL_MAX) {
+        n = VAL_MAX - 1;
+    }
+    len = ver * 131 % (VAL_MAX - 64);
+    if (len > VAL_MAX - 1 - n) {
+        len = VAL_MAX - 1 - n;
+    }
+    memset(val + n, 'a' + ver % 26, len);
+    val[n + len] = 0;
+}
+
+static int parsever(const char *key, const char *val)
+{
+    char buf[VAL_MAX];
+    int  ver;
+
+    // 值必须与 makeval 为同一个键和版本生成的完全相同, 否则返回 -1
+    if (strncmp(val, key, strlen(key)) != 0 || val[strlen(key)] != '=' ||
+        (ver = atoi(val + strlen(key) + 1)) <= 0) {
+        return -1;
+    }
+    makeval(buf, key, ver);
+    return strcmp(buf, val) == 0 ? ver : -1;
+}
+
+static void fail(const char *fmt, ...)
+{
+    va_list ap;
+    char    buf[MAXLINE];
+
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    printf("dbstress: %s\n", buf);
+    fflush(stdout);
+    __sync_fetch_and_add(&shared->nfail, 1);
+}
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}